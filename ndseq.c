@@ -14,16 +14,29 @@
   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
+#include <jack/transport.h>
 
 #define MODE_LIVE_TRIG (1)
 #define MODE_SEQUENCER (2)
@@ -36,7 +49,7 @@ void print_midi_event(const char *source, jack_midi_event_t e);
 
 int initialize_ports();
 int connect_ports();
-int initialize_seq(void *lpout);
+int initialize_seq(jack_nframes_t time);
 
 unsigned char cell(int step); // Returns the MIDI Note value associated with step.
 unsigned char color(int g, int r);
@@ -45,53 +58,1050 @@ int handle_clk_event(jack_midi_event_t event, void *ndout, void *lpout);
 int handle_launchpad_event(jack_midi_event_t event, void *ndout, void *lpout);
 int handle_norddrum_event(jack_midi_event_t event, void *ndout, void *lpout);
 
-int handle_grid_button(jack_midi_event_t midi_event, void *ndout, void *lpout);
-int handle_live_trig(jack_midi_event_t midi_event, void *ndout, void *lpout);
-int handle_letter_button(jack_midi_event_t midi_event, void *ndout, void *lpout);
-int handle_scene_button(jack_midi_event_t midi_event, void *ndout, void *lpout);
-int handle_track_button(jack_midi_event_t midi_event, void *ndout, void *lpout);
+// What a launchpad button is, worked out once for every note and CC number it could send.
+enum key_kind {
+	KEY_NONE,
+	KEY_GRID,
+	KEY_LETTER,
+	KEY_TRACK,
+	KEY_MODE,
+	KEY_SHIFT,
+	KEYS
+};
+
+struct key {
+	uint8_t kind;
+	uint8_t index;    // Grid step 0-63, letter 0-7, or track button 0-5.
+	uint8_t column;   // Grid column.
+	uint8_t velocity; // Live trig velocity for the grid row.
+};
+
+// Notes are at 0-127 and CC's at 128-255.
+struct key lp_keys[256];
+
+void init_lp_keys();
+
+int handle_ignored(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_seq_step(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_live_trig(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_letter_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_track_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_mode_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+int handle_shift_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout);
+
+// Launchpad handlers by mode and key kind. Mode 0 is before the sequencer is set up.
+int (*lp_handlers[3][KEYS])(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) = {
+	{handle_ignored, handle_ignored, handle_ignored, handle_ignored, handle_ignored, handle_ignored},
+	[MODE_LIVE_TRIG] = {handle_ignored, handle_live_trig, handle_letter_button, handle_track_button, handle_mode_button, handle_shift_button},
+	[MODE_SEQUENCER] = {handle_ignored, handle_seq_step, handle_letter_button, handle_track_button, handle_mode_button, handle_shift_button},
+};
 
 int switch_mode(jack_midi_event_t midi_event, void *ndout, void *lpout);
-int set_grid_leds(void *lpout);
-int set_track_leds(void *lpout);
-int toggle_seq_step(jack_midi_event_t midi_event, void *lpout);
+void set_grid_leds();
+void set_track_leds();
+
+// These change the state of the sequencer and update the LED's to match.
+// They must only be called on the process thread.
+void set_mode(int m);
+void select_track(int track);
+void set_step(int track, int step, int value);
 	
-int start(void *ndout, void *lpout); // start function takes buffers for MIDI output data.
-int play(int step, void *ndout, void *lpout); // play function takes buffers for MIDI output data.
-int tick(void *ndout, void *lpout); // tick function takes buffers for MIDI output data.
+// The time argument of start, play and tick is the frame offset (within the current period)
+// of the clock event that caused them. All MIDI output they produce is written at that offset.
+int start(jack_nframes_t time, void *ndout, void *lpout); // start function takes buffers for MIDI output data.
+int play(jack_nframes_t time, void *ndout, void *lpout); // play function takes buffers for MIDI output data.
+int tick(jack_nframes_t time, void *ndout, void *lpout); // tick function takes buffers for MIDI output data.
 
 int process(jack_nframes_t nframes, void *arg); // Process callback.
 
+// Shutdown.
+// SIGINT and SIGTERM are blocked in every thread, JACK's included, and main takes them with sigwait,
+// so a signal can't land on a thread that then carries on. main sets quitting and the next process cycle
+// sends the pending note-offs, all notes off on every channel a track is routed to and a Launchpad reset,
+// then posts quit_done and sends nothing from then on. main waits on quit_done, deactivates the client
+// and syncs the bank.
+#define QUIT_WAIT_SECONDS (2) // How long main waits for the last cycle before giving up on it.
+
+atomic_int quitting;
+int quit_sent; // Only touched by the process thread.
+sem_t quit_done;
+sigset_t quit_signals;
+
+void send_quit(void *lpout); // Writes the last cycle's output.
+void wait_quit(); // Waits for SIGINT or SIGTERM, then for the last cycle.
+
 uint64_t beat_clock; // MIDI beat clock counter.
 
-int curr; // Current step.
-int prev; // Previous step.
+// Clock sources.
+// By default the sequencer follows the MIDI clock (from jack_midi_clock) on the clk input.
+// With the transport clock the sequencer works out where the 24 PPQN ticks fall from the JACK transport
+// position at the start of each period, and runs them through handle_clk_event at those exact frame offsets.
+// The tempo comes from the timebase master's BBT if there is one, otherwise from clock_bpm.
+// Each tick also moves the sequencer to the step that matches the transport position, so relocating works.
+// While the transport is stopped the MIDI clock input still drives the sequencer.
+#define CLOCK_MIDI       (1)
+#define CLOCK_TRANSPORT  (2)
+#define CLOCK_EVENTS_MAX (256) // More than enough for a 4096 frame period at 300 BPM and 44.1 kHz.
+
+// Clock sources other than the raw clk input hand their events to the merge in process() through clock_events.
+struct clock_event {
+	jack_nframes_t time;       // Frame offset in the current period.
+	jack_midi_data_t *buffer;  // clock_tick_data for the ticks we generate.
+	size_t size;
+	uint64_t tick;             // Transport ticks only: ticks since the start of the transport.
+};
+
+int clock_source = CLOCK_MIDI;
+double clock_bpm = 120.0;
+struct clock_event clock_events[CLOCK_EVENTS_MAX];
+uint64_t transport_next;             // First tick the next period may claim, if it carries straight on.
+jack_nframes_t transport_next_frame; // Transport frame the next period starts at if it does.
+jack_midi_data_t clock_tick_data[1] = {0xF8};
+
+int transport_ticks(jack_nframes_t nframes); // Fills in clock_events for this period, returns how many there are or -1.
+void follow_transport(uint64_t tick);
+int get_clk_event(jack_midi_event_t *event, void *clkin, uint32_t i, int generated); // Like jack_midi_event_get.
+
+// MIDI clock smoothing.
+// A clock that comes in over USB can be off by a millisecond or more from tick to tick.
+// With clock_smooth set, the ticks on the clk input don't drive the sequencer directly. Instead they feed
+// a delay-locked loop (see Fons Adriaensen, "Using a DLL to filter time") that tracks the tick period
+// and predicts when the next tick is due, and smooth_ticks hands the sequencer ticks at the predicted frames.
+// The generated ticks never get more than one tick ahead of the real ones, so the sequencer stops soon
+// after the clock does. Until the loop has seen two ticks, and whenever a tick is further off than
+// DLL_RESYNC periods from where it was expected, the ticks are passed straight through while it locks again.
+// Start, continue and stop pass straight through and keep their place amongst the ticks.
+#define DLL_BANDWIDTH (0.01) // Loop bandwidth as a fraction of the tick rate, about 0.5 Hz at 120 BPM.
+#define DLL_RESYNC    (0.5)
+
+int clock_smooth;
+
+struct dll {
+	int locked;
+	double t1;          // Predicted frame of the next tick.
+	double e2;          // Filtered tick period in frames.
+	double prev;        // Frame of the last tick.
+	uint64_t received;  // Ticks received since the clock was started.
+	uint64_t emitted;   // Ticks handed to the sequencer since the clock was started.
+};
+
+struct dll clock_dll;
+
+void dll_update(struct dll *d, double t); // Feed the frame of a tick.
+int smooth_ticks(void *clkin, jack_nframes_t nclk, jack_nframes_t nframes); // Fills in clock_events from the clk input.
+
+// Playheads.
+// Every track has its own length and its own playhead, so tracks of different lengths drift against each other.
+// The playheads are packed 16 bits per track, four tracks to a word (lane i % 4 of word i / 4 is the step
+// track i plays next), which lets advance_heads move all of them forward and wrap each at its track's length
+// with a handful of word-wide operations and no branches (see the comment on advance_heads).
+#define TRACKS     (16)  // Must be a multiple of 4, and at most 16 (see steps in struct pattern).
+#define STEPS      (256) // Must be a multiple of 64.
+#define HEAD_WORDS (TRACKS / 4)
+#define HEADS_ONES (0x0001000100010001ULL) // 1 in each lane of a word.
+
+struct heads {
+	uint64_t w[HEAD_WORDS];
+};
+
+struct heads heads;
+int lit = -1; // Grid button lit as the playhead, -1 if none.
+
+int head(struct heads h, int track); // Step of one track.
+void set_head(struct heads *h, int track, int step);
+struct heads advance_heads(struct heads h, struct heads lengths);
+int same_heads(struct heads a, struct heads b);
+int lined_up(struct heads h); // Returns the step all the tracks are on, or -1 if they aren't on the same one.
 
 int mode; // UI mode (live trig or sequencer).
 
-int get_step_from(jack_midi_event_t midi_event); // Determine sequencer step based on a Launchpad grid MIDI event.
+// Pages.
+// The grid is a window on the sequence: it shows PAGE_STEPS steps of the current track, and the track buttons
+// (scene buttons 1-6) PAGE_TRACKS tracks. step_page and track_page say which.
+// Holding the record button (scene button 8) is shift: shift + A-D picks the step page and shift + E-G
+// the track page. Record is armed or disarmed when the button is let go, unless a page was picked.
+// Changing pages only sets the LED's, so flush_leds sends just the ones that differ.
+#define PAGE_STEPS  (64)
+#define PAGE_TRACKS (6)
+#define STEP_PAGES  (STEPS / PAGE_STEPS)
+#define TRACK_PAGES ((TRACKS + PAGE_TRACKS - 1) / PAGE_TRACKS)
+
+int step_page;
+int track_page;
+int shift;      // Set while the record button is held.
+int shift_used; // Set if a page was picked while it was.
+
+void set_step_page(int page);
+void set_track_page(int page);
+
 unsigned char get_cell_from(int step); // Determine MIDI note number for the given sequencer step.
 
-int reset_launchpad(void *lpout); // Takes a JACK port buffer.
-int update_launchpad(void *lpout); // Takes a JACK port buffer.
+int reset_launchpad(jack_nframes_t time);
+void update_launchpad();
+
+// Every MIDI message we send is a 3 byte channel message.
+// write_msg reserves exactly that much space in a JACK port buffer and fills it in place.
+#define MIDI_MSG_SIZE (3)
+
+struct midi_msg {
+	unsigned char status;
+	unsigned char data1;
+	unsigned char data2;
+};
+
+int write_msg(void *port_buffer, jack_nframes_t time, struct midi_msg msg); // Returns non-zero if the buffer is full.
+size_t bytes_written(void *port_buffer); // Adds up the size of the events in an output buffer.
+
+// Launchpad messages.
+struct midi_msg lp_led(int led, unsigned char color); // Set a LED (see LED_GRID etc. below).
+struct midi_msg lp_rapid(unsigned char first, unsigned char second); // Set the next two LED's in a rapid update.
+struct midi_msg lp_buffers(int display, int update); // Double-buffering control.
+struct midi_msg lp_reset(); // Turn off every LED and reset the buffer settings.
+
+// Launchpad LED state.
+// led_frame is what we want the Launchpad to show and led_shadow is what it is showing.
+// Drawing code only ever calls set_led, which updates led_frame and remembers the LED as dirty.
+// flush_leds, once at the end of each period, then sends a message for each dirty LED that differs from led_shadow,
+// so the amount of MIDI we send scales with the number of changes instead of the size of the grid.
+#define LED_GRID   (0)  // 64 grid buttons, indexed by sequencer step.
+#define LED_LETTER (64) // 8 "letter" buttons (A-H) on the right, top to bottom.
+#define LED_SCENE  (72) // 8 "scene launch" buttons (CC 104-111) on the top, left to right.
+#define LED_COUNT  (80)
+
+unsigned char led_frame[LED_COUNT];
+unsigned char led_shadow[LED_COUNT];
+unsigned char led_dirty[LED_COUNT]; // Indices of LED's that have been set since the last flush.
+unsigned char led_is_dirty[LED_COUNT];
+int led_ndirty;
+
+// Full page redraws use the Launchpad's double-buffering and rapid LED update (see the programmer's reference).
+// The new page is written into the buffer that is not being displayed, two LED's per message on channel 3
+// in the same order as our LED indices (grid, letter buttons, scene buttons), and then the buffers are flipped.
+// That is about half the bytes of one note-on per LED, and the whole page appears at once.
+#define LED_RAPID_MESSAGES ((LED_COUNT / 2) + 2) // Rapid update messages plus the two buffer control messages.
+
+int led_redraw; // If set, the next flush redraws the whole page.
+int lp_buffer;  // The Launchpad buffer (0 or 1) that is being displayed and updated.
 
-unsigned char ctrldata[6][64]; // Sequence data: 6 tracks x 64 steps.
-unsigned char trigdata[6][64]; // Sequence data: 6 tracks x 64 steps.
+void set_led(int led, unsigned char color);
+void redraw_leds(); // Redraw the whole page on the next flush.
+void flush_leds(jack_nframes_t time); // Queues the changed LED's on lp_queue.
+void flush_leds_rapid(jack_nframes_t time);
+
+// Launchpad output scheduler.
+// Everything we send to the Launchpad goes through lp_queue instead of straight into the output buffer.
+// At the end of each period, after all the nord drum output has been written, drain_launchpad sends
+// at most LP_BYTES_PER_PERIOD bytes (and never more than half of what is left in the buffer).
+// The rest waits for the next period, so a burst of LED updates can't fill the output buffer
+// or make the Launchpad fall behind, and cosmetic LED traffic never gets in the way of the triggers.
+#define LP_QUEUE_MAX (512) // Must be a power of 2.
+#define LP_BYTES_PER_PERIOD (32 * MIDI_MSG_SIZE)
+
+struct lp_message {
+	jack_nframes_t time; // Frame offset within the period the message was queued in.
+	struct midi_msg msg;
+};
+
+struct lp_message lp_queue[LP_QUEUE_MAX];
+unsigned int lp_queue_head; // Next message to send.
+unsigned int lp_queue_tail; // Next free slot.
+unsigned int lp_queue_late; // Number of messages at the head that were queued in an earlier period.
+
+unsigned int lp_queue_space();
+void lp_enqueue(jack_nframes_t time, struct midi_msg msg); // Caller checks lp_queue_space.
+void drain_launchpad(void *lpout); // Takes a JACK port buffer.
+
+// Controller data recorded from the nord drum (parameter locks).
+// Each step of each track can hold a few CC's that are sent just ahead of the step's trig.
+#define LOCKS_PER_STEP (4)
+#define LOCK_EMPTY (0xFF) // A CC number that MIDI can't send marks an unused slot.
+
+struct lock {
+	unsigned char cc;
+	unsigned char value;
+};
+
+// Sequence data: TRACKS tracks x STEPS steps, stored as bits.
+// trigs[track] has one bit per step, and steps holds the same bits transposed (one bit per track),
+// so play can fetch every voice of a step with one load while all the playheads are on the same step.
+// Use get_trig and set_trig, they keep the two views in sync.
+// ctrlsteps does the same for ctrldata, so play only looks at the steps that have locks.
+// Accented trigs play at full velocity, the others at the step's velocity.
+// A trig with a chance below 100 only plays that often, play rolls for it with the track's random number generator.
+// Every note gets a note-off after the track's gate length.
+#define VELOCITY_DEFAULT (100)
+#define VELOCITY_ACCENT  (127)
+#define GATE_DEFAULT     (50)
+
+struct pattern {
+	struct heads lengths;                 // Lane i is the length (1-STEPS) of track i.
+	uint64_t trigs[TRACKS][STEPS / 64];   // Bit n of word w is step 64 * w + n.
+	uint64_t accents[TRACKS][STEPS / 64]; // The same, set if the step is accented.
+	uint16_t steps[STEPS];                // Bit i is track i.
+	uint16_t ctrlsteps[STEPS];            // Bit i is set if track i has locks on this step.
+	uint8_t velocity[TRACKS][STEPS];
+	uint8_t chance[TRACKS][STEPS];  // Percent.
+	uint8_t delay[TRACKS][STEPS];   // Micro-timing: how late the trig plays, in percent of a step.
+	uint8_t ratchet[TRACKS][STEPS]; // Number of times (1-8) the trig repeats within the step.
+	uint8_t gates[TRACKS];          // Gate length of each track in percent (1-100) of a step, or of a repeat.
+	struct lock ctrldata[TRACKS][STEPS][LOCKS_PER_STEP];
+};
+
+struct pattern *pat; // The pattern that is playing, in the bank.
+
+int get_trig(const struct pattern *p, int track, int step);
+void set_trig(struct pattern *p, int track, int step, int value);
+void set_lock(struct pattern *p, int track, int step, unsigned char cc, unsigned char value);
+void clear_locks(struct pattern *p, int track);
+void set_length(struct pattern *p, int track, int length);
+void set_accent(struct pattern *p, int track, int step, int value);
+void set_velocity(struct pattern *p, int track, int step, int velocity);
+void set_chance(struct pattern *p, int track, int step, int chance);
+void set_delay(struct pattern *p, int track, int step, int delay);
+void set_ratchet(struct pattern *p, int track, int step, int ratchet);
+void set_gate(struct pattern *p, int track, int gate);
+void clear_pattern(struct pattern *p);
+
+// Random numbers for step chances, one xorshift32 generator per track.
+// The state only ever changes on the process thread, and it never runs out or allocates.
+uint32_t rng[TRACKS];
+
+uint32_t xorshift(uint32_t *state);
+int roll(int track, int chance); // Returns non-zero with a chance percent probability.
 int curr_track; // Last track that was selected.
 
+// Pattern bank.
+// Every pattern lives in a bank file. main() maps it copy-on-write, so a pattern is only read from disk
+// when something first touches it, and the process thread only ever edits the private copy: an edit
+// can't fault into the filesystem the way a shared mapping does, which is write-protected again after
+// every writeback. Each edit marks its pattern in bank_dirty, and the bank thread writes the marked
+// patterns back to the file every BANK_SYNC_SECONDS, and main once more on the way out.
+// The file is a bank_header followed by BANK_PATTERNS patterns, exactly as they are
+// laid out in memory, so it only works on the machine (or at least the architecture) that wrote it.
+// The header says so: a bank with a different version, pattern count or pattern size is refused.
+// Letter buttons A-H (and the console) queue a pattern, and play switches to it at the start of the next bar
+// by pointing pat at it. The render worker locks the queued pattern into memory first, which also makes
+// the private copy of its pages, so the process thread never waits on a page. Until it has, the switch waits for the bar after.
+#define BANK_MAGIC    "NDSEQBNK"
+#define BANK_VERSION  (5)
+#define BANK_PATTERNS (128) // Must be a multiple of 32.
+#define BANK_SYNC_SECONDS (1)
+#define BAR_STEPS     (16) // Must be a power of 2.
+
+struct bank_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t patterns;
+	uint32_t pattern_size;
+	uint32_t reserved[11]; // Pads the header to 64 bytes.
+};
+
+#define BANK_SIZE (sizeof(struct bank_header) + BANK_PATTERNS * sizeof(struct pattern))
+
+const char *bank_path = "ndseq.bank";
+struct pattern *bank;
+int bank_fd = -1; // The bank file, for writing back to. -1 if the bank is private.
+int bank_new;     // Set until a bank that was just created has all its patterns on disk and gets its header.
+atomic_uint bank_dirty[BANK_PATTERNS / 32]; // Bit i of word w is set if pattern 32 * w + i needs writing back.
+pthread_mutex_t bank_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes sync_bank, the process thread never takes it.
+int pattern_index;       // Index of pat in the bank.
+int pattern_queued = -1; // Pattern to switch to at the next bar, -1 if none.
+atomic_int bank_wanted;  // Pattern the process thread wants in memory.
+atomic_int bank_ready;   // Pattern the render worker has locked in memory.
+int bar_step;            // Step within the bar.
+int following_transport; // Set while the transport clock is placing the playheads.
+
+int open_bank(const char *path); // Maps the bank, creating it if it doesn't exist.
+int sync_bank(); // Writes the edited patterns back to the file. Never call this on the process thread.
+void *bank_thread(void *arg); // Calls sync_bank every BANK_SYNC_SECONDS.
+void touch_pattern(struct pattern *p); // Call after every edit: p gets rendered again and written back.
+int pwrite_all(int fd, const void *buf, size_t size, off_t offset); // Returns non-zero (errno set) unless it wrote everything.
+void lock_pattern(int index); // Faults a pattern in and keeps it resident.
+void queue_pattern(int index);
+void switch_pattern(); // Switches to the queued pattern if this is the start of a bar.
+void enter_pattern(struct pattern *p, int index); // Makes p the playing pattern, from the top.
+void set_pattern_leds();
+
+// Song mode.
+// A song is a chain of patterns, each played through a number of times. The console compiles it into
+// a flat list with one entry per time through, and locks every pattern in it into memory, so moving on
+// at the end of a pattern is only an index increment and a pointer load in nudge_seq.
+// A pattern has played through when its longest track has. The song loops, and starts at the next bar.
+// There are two song buffers. The console compiles into the one the process thread isn't using
+// and waits for CMD_SET_SONG to be applied (song_serial changes) before it considers the other one free.
+// Queuing a pattern by hand leaves song mode.
+#define SONG_MAX (256)
+
+struct song {
+	int count;
+	struct pattern *patterns[SONG_MAX];
+	unsigned char indices[SONG_MAX]; // Bank index of each pattern.
+};
+
+struct song songs[2];
+struct song *song; // The song that is playing, NULL if we aren't in song mode.
+int song_pos;      // Entry that is playing, -1 until the song starts.
+int song_left;     // Steps left in the entry.
+atomic_uint song_serial;
+
+int pattern_steps(const struct pattern *p); // Length of the longest track.
+void advance_song();
+int compile_song(struct song *s, char *text); // Returns non-zero if text isn't a song.
+
+// Look-ahead rendering.
+// The render worker turns the next RENDER_AHEAD steps of the pattern into the MIDI messages play has to send
+// and queues them on rendered_steps, so all play does on the process thread is copy them into the port buffer.
+// We can't know ahead of time at which frame a step will play (that's up to the clock), so only the messages
+// are rendered, play writes them at the frame of the tick. The LED's are still drawn by play.
+// Every change to the pattern bumps pattern_generation, and a rendered step that doesn't carry the current
+// generation is thrown away. So is one for the wrong playheads, after they jump.
+// play renders the step itself if there's nothing usable on the queue, and bumps render_epoch
+// to make the worker start over from render_playhead.
+// render_playhead is too big to be atomic, so it's published like the stats, with a seqlock (render_playhead_seq).
+#define RENDER_AHEAD   (8)
+#define RENDER_MSGS    (TRACKS * LOCKS_PER_STEP + TRACKS) // Every lock plus every trig.
+#define RENDER_POLL_US (2000)
+
+struct rendered_step {
+	uint64_t generation;
+	struct heads heads;
+	int count;
+	struct midi_msg msgs[RENDER_MSGS];
+	unsigned char chance[RENDER_MSGS]; // Chance of each message being sent, play rolls for the ones below 100.
+	unsigned char delay[RENDER_MSGS];
+	unsigned char ratchet[RENDER_MSGS];
+	unsigned char track[RENDER_MSGS];
+};
+
+// Scheduled events.
+// Trigs with micro-timing or ratchets don't go out on the tick. play works out the frame of every repeat
+// from step_frames, the time between the last two steps, and pushes them on pending, a binary min-heap
+// ordered by frame time with room for PENDING_MAX events. Events can land in a later period.
+// process() sends the ones that are due before each input event it handles, and the rest of the period's
+// at the end, so the output stays in time order. Anything that arrives late (after an xrun)
+// goes out at the start of the period.
+#define PENDING_MAX (512)
+
+struct pending_event {
+	jack_nframes_t frame; // Frame time (see period_frame).
+	unsigned int seq;     // Keeps events on the same frame in the order they were pushed.
+	jack_nframes_t gate;  // For note-ons, frames until the note-off.
+	int track;
+	struct midi_msg msg;
+};
+
+struct pending_event pending[PENDING_MAX];
+int npending;
+unsigned int pending_seq;
+double step_frames;             // Length of the last step in frames, 0 until we have seen two steps.
+jack_nframes_t last_step_frame;
+
+int pending_before(const struct pending_event *a, const struct pending_event *b);
+int schedule_msg(jack_nframes_t frame, int track, struct midi_msg msg, jack_nframes_t gate); // Returns non-zero if pending is full.
+struct pending_event pop_pending();
+void flush_pending(jack_nframes_t until); // Sends the events and note-offs due before frame offset until.
+void measure_step(jack_nframes_t frame);
+jack_nframes_t frame_offset(jack_nframes_t frame); // Offset of a frame time in the current period, 0 if it has passed.
+
+// Note-offs.
+// Every note-on a track sends is written by write_note, which schedules its note-off on a timing wheel:
+// WHEEL_SLOTS lists of note-offs, each covering WHEEL_SLOT_FRAMES frames, that wrap around every WHEEL_HORIZON frames.
+// Adding a note-off pushes it on the front of its slot's list, and flush_pending sends the lists of the slots
+// that have gone by along with the scheduled events, so both cost O(1) however many notes are playing.
+// A note-off goes out at the end of its slot, up to WHEEL_SLOT_FRAMES late, so it can never beat its note-on.
+// Gates are clipped to the horizon.
+// Each track has at most one note-off waiting. A note-on for a track that still has one sends the note-off
+// first and cancels the one on the wheel, which stays in its slot, marked, until the slot goes by.
+// The wheel's lists and free list are indices plus one into note_offs, so 0 (the initial value) means empty.
+#define WHEEL_SLOT_SHIFT  (5)
+#define WHEEL_SLOT_FRAMES (1 << WHEEL_SLOT_SHIFT)
+#define WHEEL_SLOTS       (2048) // Must be a power of 2.
+#define WHEEL_HORIZON     (WHEEL_SLOTS * WHEEL_SLOT_FRAMES) // About 1.4 seconds at 48 kHz.
+#define NOTE_OFFS_MAX     (256)
+
+struct note_off {
+	int next;
+	int track; // -1 if it was cancelled.
+	struct midi_msg msg;
+};
+
+struct note_off note_offs[NOTE_OFFS_MAX];
+int note_offs_free;    // Free list.
+int note_offs_fresh;   // note_offs past this many have never been used.
+int note_offs_used;    // Number on the wheel, cancelled or not.
+int wheel[WHEEL_SLOTS];
+int track_off[TRACKS]; // The note-off waiting on each track.
+struct midi_msg track_held[TRACKS]; // The note-off for a note that is held (see GATE_HELD), status 0 if none.
+jack_nframes_t wheel_time; // Start of the slot that goes by next.
+
+// A note-on written with GATE_HELD has no note-off on the wheel. It plays until its note-off is written,
+// or the track's next note-on ends it. Live trig pads are held like this.
+#define GATE_HELD ((jack_nframes_t) -1)
+
+int write_note(int track, jack_nframes_t time, struct midi_msg msg, jack_nframes_t gate); // Like write_msg, to the track's output.
+void schedule_off(int track, struct midi_msg msg, jack_nframes_t frame);
+void cancel_off(int track);
+void expire_slot(jack_nframes_t time);
+
+jack_ringbuffer_t *rendered_steps; // Holds twice RENDER_AHEAD, so there's room for fresh steps behind stale ones.
+atomic_ulong pattern_generation;
+atomic_uint render_epoch;
+_Atomic(struct pattern *) render_pattern; // pat, published for the render worker before the generation changes.
+struct heads render_playhead; // The heads that play next.
+atomic_uint render_playhead_seq;
+
+void render_step(const struct pattern *p, struct heads h, struct rendered_step *r);
+int take_rendered(struct heads h, struct rendered_step *r); // Returns non-zero if the step isn't ready.
+void publish_playhead(struct heads h); // Only called on the process thread.
+struct heads read_playhead();
+void *render_thread(void *arg);
+
+// The render worker's state between passes.
+struct render_worker {
+	uint64_t generation;
+	unsigned int epoch;
+	struct heads next;
+	size_t rendered;
+	int ready;
+};
+
+void render_ahead(struct render_worker *w);
+
 jack_client_t *client;
 jack_port_t *mclk_input; // receive jack_midi_clock data
 jack_port_t *launchpad_input; // receive Launchpad MIDI events
 jack_port_t *launchpad_output; // send MIDI data to the Launchpad
 jack_port_t *norddrum_input; // receive MIDI data from the Nord Drum
-jack_port_t *norddrum_output; // send MIDI data to the Nord Drum
 jack_ringbuffer_t *norddrum_events;
 jack_status_t status;
 
-int main() {
+// Outputs.
+// Each track plays through its route: an output port, a MIDI channel and a note.
+// outputs[0] is the nord drum, -o NAME registers another output port called NAME and
+// -m TRACK=OUTPUT:CHANNEL:NOTE routes a track to it (tracks, outputs and channels count from 1).
+// By default track i plays note 60 on channel i of the nord drum.
+// render_step bakes the routes into the messages of a step, and keeps the track of each one
+// so play and write_note can find the output without looking at the pattern again.
+#define OUTPUTS_MAX (4)
+
+struct route {
+	uint8_t output;
+	uint8_t channel;
+	uint8_t note;
+};
+
+struct route routes[TRACKS] = {
+	{0, 0, 60}, {0, 1, 60}, {0, 2, 60}, {0, 3, 60}, {0, 4, 60}, {0, 5, 60}, {0, 6, 60}, {0, 7, 60},
+	{0, 8, 60}, {0, 9, 60}, {0, 10, 60}, {0, 11, 60}, {0, 12, 60}, {0, 13, 60}, {0, 14, 60}, {0, 15, 60},
+};
+jack_port_t *outputs[OUTPUTS_MAX];
+const char *output_names[OUTPUTS_MAX] = {"nord drum output"};
+int noutputs = 1;
+void *output_buffers[OUTPUTS_MAX]; // This period's, process sets them up before anything else.
+
+int set_route(const char *arg); // Sets a route from TRACK=OUTPUT:CHANNEL:NOTE. Returns non-zero if it's no good.
+
+// The CC's recorded from the nord drum input belong to the track routed to their channel on the first output.
+// channel_tracks is the reverse of routes for that output, -1 for a channel no track plays on.
+// If tracks share a channel the lowest one gets the CC's.
+int8_t channel_tracks[16];
+
+void map_channels(); // Fills in channel_tracks, once the routes are set.
+
+// MIDI backend.
+// process and everything it calls go through backend for MIDI buffers, frame times and the transport,
+// never straight to JACK, so the sequencer can run without a server.
+// jack_backend is the real thing. fake_backend keeps a buffer in memory for each port and counts frames
+// itself, bench points the ports at fake_buffers and calls process in a loop as fast as it can.
+struct backend {
+	void *(*port_buffer)(jack_port_t *port, jack_nframes_t nframes);
+	uint32_t (*event_count)(void *buffer);
+	int (*event_get)(jack_midi_event_t *event, void *buffer, uint32_t i);
+	void (*clear_buffer)(void *buffer);
+	int (*event_write)(void *buffer, jack_nframes_t time, const jack_midi_data_t *data, size_t size);
+	jack_midi_data_t *(*event_reserve)(void *buffer, jack_nframes_t time, size_t size);
+	size_t (*max_event_size)(void *buffer);
+	jack_nframes_t (*last_frame_time)();
+	jack_nframes_t (*sample_rate)();
+	jack_transport_state_t (*transport_query)(jack_position_t *pos);
+};
+
+#define FAKE_EVENTS_MAX (1024)
+#define FAKE_PORTS      (4 + OUTPUTS_MAX)
+
+struct fake_buffer {
+	uint32_t count;
+	size_t used; // Bytes of data used.
+	jack_midi_event_t events[FAKE_EVENTS_MAX];
+	jack_midi_data_t data[FAKE_EVENTS_MAX * MIDI_MSG_SIZE];
+};
+
+struct fake_buffer fake_buffers[FAKE_PORTS];
+jack_nframes_t fake_frame; // Frame time of the current period.
+jack_nframes_t fake_rate = 48000;
+
+jack_nframes_t client_last_frame_time();
+jack_nframes_t client_sample_rate();
+jack_transport_state_t client_transport_query(jack_position_t *pos);
+void *fake_port_buffer(jack_port_t *port, jack_nframes_t nframes);
+uint32_t fake_event_count(void *buffer);
+int fake_event_get(jack_midi_event_t *event, void *buffer, uint32_t i);
+void fake_clear_buffer(void *buffer);
+int fake_event_write(void *buffer, jack_nframes_t time, const jack_midi_data_t *data, size_t size);
+jack_midi_data_t *fake_event_reserve(void *buffer, jack_nframes_t time, size_t size);
+size_t fake_max_event_size(void *buffer);
+jack_nframes_t fake_last_frame_time();
+jack_nframes_t fake_sample_rate();
+jack_transport_state_t fake_transport_query(jack_position_t *pos);
+
+struct backend jack_backend = {
+	jack_port_get_buffer,
+	jack_midi_get_event_count,
+	jack_midi_event_get,
+	jack_midi_clear_buffer,
+	jack_midi_event_write,
+	jack_midi_event_reserve,
+	jack_midi_max_event_size,
+	client_last_frame_time,
+	client_sample_rate,
+	client_transport_query,
+};
+
+struct backend fake_backend = {
+	fake_port_buffer,
+	fake_event_count,
+	fake_event_get,
+	fake_clear_buffer,
+	fake_event_write,
+	fake_event_reserve,
+	fake_max_event_size,
+	fake_last_frame_time,
+	fake_sample_rate,
+	fake_transport_query,
+};
+
+struct backend *backend = &jack_backend;
+
+// Connections.
+// Each of our ports is connected to the first port of another client whose name contains the pattern
+// of its link. The patterns default to the devices ndseq was written for, -p NAME=PATTERN or a line
+// NAME=PATTERN in the file given to -c changes them. Both of a device's links share the NAME.
+// The outputs added with -o are output2 and up, they don't connect to anything until they get a pattern.
+// connect_ports fetches the port list once at startup. After that the port registration callback
+// queues every port that comes or goes on registrations and wakes the connector thread, which only
+// connects the new port to the links that are waiting for one, or forgets the peer that went away,
+// so plugging a device back in never rescans the graph. If registrations fills up the connector
+// falls back to connect_ports. A peer is forgotten once our port isn't connected to it any more,
+// rather than once its name is gone: a device that is unplugged and plugged back in before the
+// connector gets to the queue is there again under the same name, but not connected.
+#define PATTERN_MAX       (64)
+#define REGISTRATIONS_MAX (64)
+#define PORT_NAME_MAX     (320) // What jack_port_name_size returns, client name included.
+
+struct link {
+	const char *name;
+	char pattern[PATTERN_MAX];
+	jack_port_t **port;          // Our end.
+	unsigned long flags;         // JackPortIsInput or JackPortIsOutput, for the other end.
+	char peer[PORT_NAME_MAX];    // The other end, empty until it's connected.
+};
+
+struct registration {
+	jack_port_id_t id;
+	int registered;
+};
+
+struct link links[] = {
+	{"launchpad", "Launchpad Mini", &launchpad_input, JackPortIsOutput},
+	{"launchpad", "Launchpad Mini", &launchpad_output, JackPortIsInput},
+	{"clock", "jack_midi_clock", &mclk_input, JackPortIsOutput},
+	{"norddrum", "Scarlett 6i6", &outputs[0], JackPortIsInput},
+	{"norddrum", "Scarlett 6i6", &norddrum_input, JackPortIsOutput},
+	{"output2", "", &outputs[1], JackPortIsInput},
+	{"output3", "", &outputs[2], JackPortIsInput},
+	{"output4", "", &outputs[3], JackPortIsInput},
+};
+
+#define LINKS (sizeof(links) / sizeof(links[0]))
+
+jack_ringbuffer_t *registrations;
+atomic_int registrations_lost; // Set if a registration didn't fit.
+sem_t connector_wake;
+
+int set_pattern(const char *arg); // Sets a pattern from NAME=PATTERN. Returns non-zero if it doesn't name a link.
+int read_patterns(const char *path);
+int connect_port(const char *name); // Connects the port called name to the links that are waiting for it.
+void port_registered(jack_port_id_t id, int registered, void *arg); // Port registration callback.
+void *connector_thread(void *arg);
+void drop_lost_peers(); // Forgets the peers our ports aren't connected to any more.
+
+// CC's from the nord drum are queued on norddrum_events as fixed-size records until the next clock event,
+// which stores them on the step that is about to play.
+// We can't queue the jack_midi_event_t itself because its buffer is only valid during the cycle.
+// The record size is a power of 2, like the ringbuffer, so a record never wraps around the end of it
+// and can be written and read in place.
+#define NORDDRUM_EVENTS_MAX (64) // Arbitrary size.
+
+struct nd_record {
+	jack_nframes_t frame; // Frame time (see period_frame) the event arrived at.
+	unsigned char status;
+	unsigned char data1;
+	unsigned char data2;
+	unsigned char track; // Worked out from the channel by queue_ctrl.
+};
+
+int ctrl_record; // If set, CC's from the nord drum are recorded, and in live trig mode so are the pads.
+jack_nframes_t period_frame; // Frame time of the first frame of the current period.
+
+int queue_ctrl(jack_midi_event_t midi_event); // Returns non-zero if the queue is full.
+void record_ctrl(jack_nframes_t frame); // Stores the queued CC's that arrived up to frame.
+void toggle_ctrl_record();
+
+// Live recording.
+// While recording in live trig mode every pad hit is also written into the pattern (overdub).
+// The hit's frame time is measured against the step that is playing, last_step_frame and step_frames,
+// and stored as a trig on that step with the rest as micro-timing, so it plays back where it was hit.
+// With record_quantize the hit snaps to the nearest step instead.
+// A hit that lands on the step that plays next has already been heard, so that step's note for the track
+// is skipped once (overdub_skip) instead of flamming with it.
+int record_quantize;
+uint16_t overdub_skip; // Bit i is set if track i skips its next note-on.
+
+void record_trig(int track, jack_nframes_t frame, int velocity);
+
+uint8_t pad_tracks[PAGE_STEPS]; // The track (plus one) each live trig pad that is down is playing, 0 if none.
+
+// RT-safe logging.
+// The process callback must never call printf and friends because they can block,
+// so it pushes fixed-size records onto a lock-free ringbuffer instead
+// and the logger thread started by main() prints them.
+#define LOG_EVENTS_MAX (256) // Arbitrary size.
+
+struct log_record {
+	const char *fmt; // Must be a string literal: it is printed after the caller has returned.
+	long args[2];
+};
+
+jack_ringbuffer_t *log_events;
+atomic_ulong log_dropped; // Number of records that did not fit in log_events.
+
+void rt_log(const char *msg); // Log a message from the process thread.
+void rt_logf(const char *fmt, long a, long b); // Log a message with up to two long arguments from the process thread.
+void *log_thread(void *arg); // Drains log_events. Runs until the program exits.
+
+// Telemetry.
+// With -u the process thread also pushes a record for every step it plays and every note-on it sends
+// onto tap_events, the same way rt_log does, and the tap thread sends them out in batches over a UDP
+// or UNIX datagram socket. Nothing about the socket ever touches the process callback: if the consumer
+// is slow or gone the records are dropped and counted.
+// Each datagram is a struct tap_header followed by up to TAP_BATCH records, in host byte order.
+// The record size is a power of 2, like the ringbuffer, so a record never wraps around the end of it.
+#define TAP_EVENTS_MAX  (1024) // About a second and a half of every track ratcheting at 300 BPM.
+#define TAP_BATCH       (64)
+#define TAP_INTERVAL_US (5000)
+
+enum tap_type {
+	TAP_STEP = 1, // track is the pattern, value the step in the bar.
+	TAP_TRIG = 2, // A note-on: value is the velocity.
+};
+
+struct tap_record {
+	uint32_t frame; // Frame time (see period_frame).
+	uint8_t type;
+	uint8_t track;
+	uint16_t value;
+};
+
+struct tap_header {
+	uint32_t sequence; // Counts datagrams, so gaps show lost ones.
+	uint32_t dropped;  // Records that didn't fit in tap_events, since the start.
+};
+
+const char *tap_address; // HOST:PORT for UDP, or a path for a UNIX socket. NULL if there's no telemetry.
+jack_ringbuffer_t *tap_events;
+atomic_ulong tap_dropped;
+int tap_fd;
+
+int open_tap(const char *address); // Returns a connected socket, or -1.
+void tap(jack_nframes_t frame, int type, int track, int value); // Only called on the process thread.
+void *tap_thread(void *arg);
+
+// Commands from non-RT threads.
+// The sequencer state (pat, curr_track, mode) is owned by the process thread.
+// Anything else that wants to change it posts a command, and process() applies
+// the pending commands at the start of the next cycle, so heavy work like parsing or
+// file I/O stays off the audio thread and nothing ever races with the sequencer.
+#define COMMANDS_MAX (256) // Arbitrary size.
+
+enum command_type {
+	CMD_SET_MODE,     // Set mode to value.
+	CMD_SELECT_TRACK, // Select track.
+	CMD_SET_STEP,     // Set the trig at track and step to value.
+	CMD_CLEAR_TRACK,  // Set every step of track to 0 and remove its locks.
+	CMD_SET_LENGTH,   // Set the length of track to value.
+	CMD_QUEUE_PATTERN, // Switch to pattern value at the next bar.
+	CMD_SET_SONG,     // Play songs[value] from the next bar, or leave song mode if value is -1.
+	CMD_SET_ACCENT,   // Accent the trig at track and step if value is non-zero.
+	CMD_SET_VELOCITY, // Set the velocity (1-127) of the trig at track and step.
+	CMD_SET_CHANCE,   // Set the chance (0-100) of the trig at track and step.
+	CMD_SET_DELAY,    // Set the micro-timing (0-99) of the trig at track and step.
+	CMD_SET_RATCHET,  // Set the number of repeats (1-8) of the trig at track and step.
+	CMD_SET_GATE,     // Set the gate length (1-100) of track.
+	CMD_INITIALIZE,   // Reset the Launchpad and the sequencer. main posts it once, before activating.
+};
+
+struct command {
+	int type;
+	int track;
+	int step;
+	int value;
+};
+
+jack_ringbuffer_t *commands;
+pthread_mutex_t commands_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes producers, the process thread never takes it.
+
+int post_command(struct command cmd); // Returns non-zero if the queue is full. Never call this on the process thread.
+void apply_commands(); // Applies all the pending commands. Only called on the process thread.
+void apply_command(struct command cmd);
+void *console_thread(void *arg); // Reads commands from stdin until EOF.
+
+// Process callback statistics.
+// The process thread adds up timings, event counts and queue fill levels in stats_acc without locks
+// or allocation, and about once a second publishes them to stats_snapshot and starts over.
+// stats_seq is odd while the snapshot is being written, so a reader that sees it odd,
+// or sees it change while copying, tries again (a seqlock).
+// The stats thread started by main() prints the latest snapshot every stats_interval seconds.
+#define STATS_WINDOW_NS (1000000000ULL)
+
+enum section {
+	SECTION_COMMANDS,  // apply_commands
+	SECTION_NORDDRUM,  // queuing nord drum CC's
+	SECTION_LAUNCHPAD, // handle_launchpad_event
+	SECTION_CLK,       // handle_clk_event
+	SECTION_LEDS,      // flush_leds and drain_launchpad
+	SECTIONS,
+};
+
+struct timing {
+	uint64_t min; // Nanoseconds.
+	uint64_t max;
+	uint64_t total;
+	unsigned long count;
+};
+
+struct stats {
+	unsigned long periods;
+	uint64_t period_ns;                // Length of a period.
+	struct timing process;             // The whole callback.
+	struct timing sections[SECTIONS];  // Time spent in each section per period.
+	uint64_t worst[SECTIONS];          // Time spent in each section during the slowest period.
+	unsigned long events_in;
+	unsigned long nd_bytes_out;
+	unsigned long lp_bytes_out;
+	unsigned int lp_queue_max;         // Highest fill levels seen at the end of a period.
+	size_t norddrum_events_max;
+	size_t log_events_max;
+	size_t commands_max;
+	double bpm;                        // Tempo of the clk input as tracked by the DLL, 0 if it isn't locked.
+	unsigned long render_misses;       // Steps play had to render itself.
+	struct timing live_trig;           // From the start of the period to a live trig's note being written.
+	unsigned long live_trig_drops;     // Live trig notes that didn't fit in the output buffer.
+	int pending_max;
+	unsigned long pending_drops;       // Scheduled events that didn't fit in pending.
+	int note_offs_max;
+	unsigned long note_off_drops;      // Note-ons that didn't get a note-off because note_offs was full.
+};
+
+struct stats stats_acc; // Only touched by the process thread.
+struct stats stats_snapshot;
+atomic_uint stats_seq;
+atomic_ulong xruns;
+uint64_t stats_window_start;
+uint64_t process_start_ns; // When the current period's process callback started.
+int stats_interval; // Seconds between printing stats, 0 means never.
+
+uint64_t now_ns(); // Monotonic clock, safe to call from the process thread.
+void add_timing(struct timing *t, uint64_t ns);
+void publish_stats(uint64_t now);
+int read_stats(struct stats *s); // Copies the latest snapshot. Returns non-zero if there isn't one yet.
+int xrun(void *arg); // XRun callback.
+void *stats_thread(void *arg); // Prints stats every stats_interval seconds.
+
+// Benchmark.
+// bench runs the sequencer offline on fake_backend for bench_periods periods of BENCH_NFRAMES frames
+// and reports the CPU time of each process call and the bytes it sent, plus a hash of all the output
+// so a change in behaviour shows up as well as a change in speed.
+// The render worker isn't started and the random number generators get a fixed seed,
+// so the same input gives the same output every time.
+// The input is a recording, one event per line:
+//
+//   PERIOD clk|lp|nd OFFSET BYTE...   (bytes in hex)
+//
+// replayed from the top when it runs out. Without one bench sends a start and a MIDI clock at clock_bpm,
+// and presses a few pads on every track in the first period. With bench_dump every output event is printed
+// to stdout in the same format.
+#define BENCH_NFRAMES (256)
+#define BENCH_SEED    (0x2545F491u)
+
+enum fake_port {FAKE_CLK_IN, FAKE_LP_IN, FAKE_ND_IN, FAKE_LP_OUT, FAKE_OUT}; // Then the rest of the outputs.
+
+struct bench_event {
+	unsigned long period;
+	int port;
+	jack_nframes_t time;
+	size_t size;
+	jack_midi_data_t data[MIDI_MSG_SIZE];
+};
+
+unsigned long bench_periods; // 0 unless we're benchmarking.
+const char *bench_path;      // Recording to replay, or NULL.
+int bench_dump;
+int bank_private;            // Map the bank copy-on-write, so playing with it never changes the file.
+
+int bench(); // Returns non-zero if it couldn't run.
+int load_recording(const char *path, struct bench_event **events, size_t *n);
+int add_bench_event(struct bench_event **events, size_t *n, struct bench_event e);
+
+void usage(const char *prog);
+
+int main(int argc, char **argv) {
 	int rc = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "B:b:c:df:hjm:o:p:qr:s:tu:")) != -1) {
+		switch (opt) {
+		case 'o':
+			if (noutputs == OUTPUTS_MAX) {
+				fprintf(stderr, "at most %d outputs\n", OUTPUTS_MAX);
+				exit(1);
+			}
+			output_names[noutputs++] = optarg;
+			break;
+		case 'm':
+			if (set_route(optarg) != 0) {
+				fprintf(stderr, "expected TRACK=OUTPUT:CHANNEL:NOTE, not %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			if (read_patterns(optarg) != 0) {
+				exit(1);
+			}
+			break;
+		case 'p':
+			if (set_pattern(optarg) != 0) {
+				fprintf(stderr, "unknown port: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'B':
+			bench_periods = strtoul(optarg, NULL, 10);
+			bank_private = 1;
+			break;
+		case 'r':
+			bench_path = optarg;
+			break;
+		case 'd':
+			bench_dump = 1;
+			break;
+		case 'f':
+			bank_path = optarg;
+			break;
+		case 'j':
+			clock_smooth = 1;
+			break;
+		case 'q':
+			record_quantize = 1;
+			break;
+		case 'b':
+			clock_bpm = atof(optarg);
+			break;
+		case 't':
+			clock_source = CLOCK_TRANSPORT;
+			break;
+		case 's':
+			stats_interval = atoi(optarg);
+			break;
+		case 'u':
+			tap_address = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	for (int i = 0; i < TRACKS; i++) {
+		if (routes[i].output >= noutputs) {
+			fprintf(stderr, "track %d goes to output %d, but there are only %d\n", i + 1, routes[i].output + 1, noutputs);
+			exit(1);
+		}
+	}
+	map_channels();
+
+	norddrum_events = jack_ringbuffer_create(NORDDRUM_EVENTS_MAX * sizeof(struct nd_record));
+	if (norddrum_events == NULL) {
+		die("failed to allocate nord drum events");
+	}
+	log_events = jack_ringbuffer_create(LOG_EVENTS_MAX * sizeof(struct log_record));
+	if (log_events == NULL) {
+		die("failed to allocate log events");
+	}
+	commands = jack_ringbuffer_create(COMMANDS_MAX * sizeof(struct command));
+	if (commands == NULL) {
+		die("failed to allocate commands");
+	}
+	rendered_steps = jack_ringbuffer_create(2 * RENDER_AHEAD * sizeof(struct rendered_step) + 1);
+	if (rendered_steps == NULL) {
+		die("failed to allocate rendered steps");
+	}
+	if (tap_address != NULL) {
+		tap_fd = open_tap(tap_address);
+		if (tap_fd < 0) {
+			die("failed to open telemetry socket");
+		}
+		tap_events = jack_ringbuffer_create(TAP_EVENTS_MAX * sizeof(struct tap_record));
+		if (tap_events == NULL) {
+			die("failed to allocate telemetry events");
+		}
+		jack_ringbuffer_mlock(tap_events);
+	}
+	// Keep the ringbuffers resident so the process callback never page faults on them.
+	jack_ringbuffer_mlock(rendered_steps);
+	jack_ringbuffer_mlock(norddrum_events);
+	jack_ringbuffer_mlock(log_events);
+	jack_ringbuffer_mlock(commands);
 
-	norddrum_events = jack_ringbuffer_create(64 * sizeof(jack_midi_event_t)); // Arbitrary size.
+	// Block SIGINT and SIGTERM before any thread starts, so they all inherit the mask.
+	// A benchmark doesn't wait for them, it can just be killed.
+	sigemptyset(&quit_signals);
+	sigaddset(&quit_signals, SIGINT);
+	sigaddset(&quit_signals, SIGTERM);
+	if (bench_periods == 0 && pthread_sigmask(SIG_BLOCK, &quit_signals, NULL) != 0) {
+		die("failed to block signals");
+	}
+	// Map the pattern bank.
+	rc = open_bank(bank_path);
+	if (rc != 0) {
+		die("failed to open pattern bank");
+	}
+	// Start printing messages from the process callback.
+	pthread_t logger;
+	rc = pthread_create(&logger, NULL, log_thread, NULL);
+	if (rc != 0) {
+		die("failed to start logger thread");
+	}
+	// Send telemetry.
+	if (tap_events != NULL) {
+		pthread_t tapper;
+		rc = pthread_create(&tapper, NULL, tap_thread, NULL);
+		if (rc != 0) {
+			die("failed to start telemetry thread");
+		}
+	}
+	if (bench_periods > 0) {
+		return bench();
+	}
 
 	// Create the client.
 	client = jack_client_open("ndtrig", JackNoStartServer, &status);
@@ -107,6 +1117,33 @@ int main() {
 	if (rc != 0) {
 		die("failed to set JACK process callback");
 	}
+	// Count xruns.
+	rc = jack_set_xrun_callback(client, xrun, NULL);
+	if (rc != 0) {
+		die("failed to set JACK xrun callback");
+	}
+	// Reconnect devices that are plugged in later.
+	registrations = jack_ringbuffer_create(REGISTRATIONS_MAX * sizeof(struct registration));
+	if (registrations == NULL) {
+		die("failed to allocate registrations");
+	}
+	if (sem_init(&connector_wake, 0, 0) != 0) {
+		die("failed to initialize connector semaphore");
+	}
+	rc = jack_set_port_registration_callback(client, port_registered, NULL);
+	if (rc != 0) {
+		die("failed to set JACK port registration callback");
+	}
+	// Stop on SIGINT and SIGTERM.
+	if (sem_init(&quit_done, 0, 0) != 0) {
+		die("failed to initialize quit semaphore");
+	}
+	// Reset the launchpad and initialize the sequencer on the first process cycle,
+	// so the sequencer state and the LED queue are only ever touched by the process thread.
+	// The LED's go through the scheduler like any others and are sent in that same cycle.
+	if (post_command((struct command) {CMD_INITIALIZE, 0, 0, 0}) != 0) {
+		die("failed to queue initialization");
+	}
 	// Activate the client.
 	rc = jack_activate(client);
 	if (rc != 0) {
@@ -117,36 +1154,120 @@ int main() {
 	if (rc != 0) {
 		die("failed to connect ports");
 	}
-	// Buffer for data we will send to the nord drum.
-	void *lpout = jack_port_get_buffer(launchpad_output, 1024);
-	
-	// Reset all the buttons on the launchpad.
-	rc = reset_launchpad(lpout);
+	pthread_t connector;
+	rc = pthread_create(&connector, NULL, connector_thread, NULL);
 	if (rc != 0) {
-		die("failed to reset launchpad");
+		die("failed to start connector thread");
 	}
-	// Initialize the state of the sequencer.
-	rc = initialize_seq(lpout);
+	// Save edits to the bank file.
+	pthread_t banker;
+	rc = pthread_create(&banker, NULL, bank_thread, NULL);
 	if (rc != 0) {
-		die("failed to initialize sequencer");
+		die("failed to start bank thread");
 	}
-	// Wait.
-	while (1) {
-		sleep(1);
+	// Render steps ahead of the playhead.
+	pthread_t render;
+	rc = pthread_create(&render, NULL, render_thread, NULL);
+	if (rc != 0) {
+		die("failed to start render thread");
+	}
+	// Accept commands on stdin.
+	pthread_t console;
+	rc = pthread_create(&console, NULL, console_thread, NULL);
+	if (rc != 0) {
+		die("failed to start console thread");
+	}
+	// Print stats.
+	if (stats_interval > 0) {
+		pthread_t stats;
+		rc = pthread_create(&stats, NULL, stats_thread, NULL);
+		if (rc != 0) {
+			die("failed to start stats thread");
+		}
 	}
-	// TODO: cleanup in a signal handler.
+	// Wait for SIGINT or SIGTERM and the cycle that silences everything.
+	wait_quit();
+
 	// Deactivate the client.
-	printf("deactivating client");
+	fprintf(stderr, "deactivating client\n");
 	rc = jack_deactivate(client);
 	if (rc != 0) {
 		die("failed to deactivate JACK client");
 	}
+	// Write the bank back to disk.
+	rc = sync_bank();
+	if (rc != 0) {
+		fprintf(stderr, "failed to sync pattern bank\n");
+	}
 	// Close the client.
-	printf("closing client");
+	fprintf(stderr, "closing client\n");
 	rc = jack_client_close(client);
 	if (rc != 0) {
 		die("failed to close JACK client");
 	}
+	return 0;
+}
+
+// send_quit ends every note that is still on and turns the Launchpad off.
+// Everything goes out at the start of the period, the nord drum first.
+void send_quit(void *lpout) {
+	uint16_t channels[OUTPUTS_MAX] = {0};
+
+	for (int i = 0; i < TRACKS; i++) {
+		void *out = output_buffers[routes[i].output];
+
+		if (track_off[i] != 0 || track_held[i].status != 0) {
+			struct midi_msg off = track_off[i] != 0 ? note_offs[track_off[i] - 1].msg : track_held[i];
+
+			cancel_off(i);
+			if (write_msg(out, 0, off) != 0) {
+				rt_log("error writing note-off on quit\n");
+			}
+		}
+		channels[routes[i].output] |= 1 << routes[i].channel;
+	}
+	for (int i = 0; i < noutputs; i++) {
+		for (int c = 0; c < 16; c++) {
+			if ((channels[i] & (1 << c)) == 0) {
+				continue;
+			}
+			if (write_msg(output_buffers[i], 0, (struct midi_msg) {0xB0 + c, 123, 0}) != 0) {
+				rt_log("error writing all notes off on quit\n");
+			}
+		}
+	}
+	// Whatever LED traffic is still queued is dropped.
+	lp_queue_head = lp_queue_tail;
+	lp_queue_late = 0;
+	if (write_msg(lpout, 0, lp_reset()) != 0) {
+		rt_log("error resetting launchpad on quit\n");
+	}
+}
+
+// wait_quit blocks until SIGINT or SIGTERM comes and the process thread has sent its last cycle.
+// If no cycle comes (the server stopped calling us) it gives up after QUIT_WAIT_SECONDS.
+void wait_quit() {
+	int sig;
+
+	if (sigwait(&quit_signals, &sig) != 0) {
+		die("waiting for a signal");
+	}
+	atomic_store_explicit(&quitting, 1, memory_order_release);
+
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += QUIT_WAIT_SECONDS;
+
+	while (sem_timedwait(&quit_done, &deadline) != 0) {
+		if (errno == ETIMEDOUT) {
+			fprintf(stderr, "no process cycle after quitting, notes may be left on\n");
+			return;
+		}
+		if (errno != EINTR) {
+			die("waiting to quit");
+		}
+	}
 }
 
 int initialize_ports() {
@@ -176,356 +1297,607 @@ int initialize_ports() {
 		fprintf(stderr, "failed to register nord drum input port");
 		return 1;
 	}
-	// Register nord drum output port (send data to nord drum).
-	norddrum_output = jack_port_register(client, "nord drum output", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-	if (norddrum_output == NULL) {
-		fprintf(stderr, "failed to register nord drum output port");
-		return 1;
+	// Register the output ports, the first one sends data to the nord drum.
+	for (int i = 0; i < noutputs; i++) {
+		outputs[i] = jack_port_register(client, output_names[i], JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+		if (outputs[i] == NULL) {
+			fprintf(stderr, "failed to register output port %s", output_names[i]);
+			return 1;
+		}
 	}
 	return 0;
 }
 
+// connect_ports connects every link it can find a port for.
+// Devices that aren't there are left for the connector thread.
 int connect_ports() {
-	int rc = 0;
-	
-	const char *lpin;
-	const char *lpout;
-	const char *mclkout;
-	const char *scarin;
-	const char *scarout;
-
-	// Discover jack inputs.
-	const char **jack_inputs = jack_get_ports(client, "", "", JackPortIsInput);
-	if (jack_inputs == NULL) {
-		fprintf(stderr, "jack_inputs is NULL");
-		return 1;
+	const char **ports = jack_get_ports(client, NULL, JACK_DEFAULT_MIDI_TYPE, 0);
+	if (ports == NULL) {
+		fprintf(stderr, "no MIDI ports\n");
+		return 0;
 	}
-	while (jack_inputs != NULL && *jack_inputs != NULL) {
-		char *lpss = strstr(*jack_inputs, "Launchpad Mini");
-		char *scss = strstr(*jack_inputs, "Scarlett 6i6"); // TODO: this should be a command-line flag.
+	for (const char **p = ports; *p != NULL; p++) {
+		connect_port(*p);
+	}
+	jack_free(ports);
 
-		if (lpss != NULL) {
-			lpin = *jack_inputs;
-		} else if (scss != NULL) {
-			scarin = *jack_inputs;
+	for (size_t i = 0; i < LINKS; i++) {
+		if (*links[i].port != NULL && links[i].pattern[0] != '\0' && links[i].peer[0] == '\0') {
+			fprintf(stderr, "no port matching %s for %s, waiting for it\n", links[i].pattern, jack_port_name(*links[i].port));
 		}
-		jack_inputs++;
 	}
+	return 0;
+}
 
-	// Discover jack outputs.
-	const char **jack_outputs = jack_get_ports(client, "", "", JackPortIsOutput);
-	if (jack_outputs == NULL) {
-		fprintf(stderr, "jack_outputs is NULL");
-		return 1;
-	}
-	while (jack_outputs != NULL && *jack_outputs != NULL) {
-		char *lpss = strstr(*jack_outputs, "Launchpad Mini");
-		char *mclkss = strstr(*jack_outputs, "jack_midi_clock");
-		char *scss = strstr(*jack_outputs, "Scarlett 6i6"); // TODO: this should be a command-line flag.
+int connect_port(const char *name) {
+	jack_port_t *port = jack_port_by_name(client, name);
 
- 		if (lpss != NULL) {
-			lpout = *jack_outputs;
-		} else if (mclkss != NULL) {
-			mclkout = *jack_outputs;
-		} else if (scss != NULL) {
-			scarout = *jack_outputs;
-		}
-		jack_outputs++;
+	if (port == NULL || jack_port_is_mine(client, port)) {
+		return 0;
 	}
+	int flags = jack_port_flags(port);
 
-	// Receive MIDI from launchpad.
-	rc = jack_connect(client, lpout, jack_port_name(launchpad_input));
-	if (rc != 0) {
-		fprintf(stderr, "Failed to connect to launchpad output: %s\n", lpout);
-		return rc;
-	}
-	// Send MIDI to launchpad.
-	rc = jack_connect(client, jack_port_name(launchpad_output), lpin);
-	if (rc != 0) {
-		fprintf(stderr, "Failed to connect to launchpad input: %s\n", lpin);
-		return rc;
-	}
-	// Receive MIDI from jack_midi_clock.
-	rc = jack_connect(client, mclkout, jack_port_name(mclk_input));
-	if (rc != 0) {
-		fprintf(stderr, "Failed to connect to mclk output: %s\n", mclkout);
-		return rc;
-	}
-	// Send MIDI to the nord drum.
-	rc = jack_connect(client, jack_port_name(norddrum_output), scarin);
-	if (rc != 0) {
-		fprintf(stderr, "Failed to connect to scarlett 6i6 input: %s\n", scarin);
-		return rc;
-	}
-	// Receive MIDI from the nord drum.
-	rc = jack_connect(client, scarout, jack_port_name(norddrum_input));
-	if (rc != 0) {
-		fprintf(stderr, "Failed to connect to scarlett 6i6 output: %s\n", scarout);
-		return rc;
+	for (size_t i = 0; i < LINKS; i++) {
+		struct link *l = &links[i];
+		int rc = 0;
+
+		if (*l->port == NULL || l->pattern[0] == '\0' || l->peer[0] != '\0' || !(flags & l->flags) || strstr(name, l->pattern) == NULL) {
+			continue;
+		}
+		if (l->flags & JackPortIsOutput) {
+			rc = jack_connect(client, name, jack_port_name(*l->port));
+		} else {
+			rc = jack_connect(client, jack_port_name(*l->port), name);
+		}
+		if (rc != 0 && rc != EEXIST) {
+			fprintf(stderr, "failed to connect %s to %s\n", jack_port_name(*l->port), name);
+			continue;
+		}
+		snprintf(l->peer, sizeof(l->peer), "%s", name);
+		fprintf(stderr, "connected %s to %s\n", jack_port_name(*l->port), name);
 	}
 	return 0;
 }
 
-void die(const char *msg) {
-	fprintf(stderr, "%s\n", msg);
-	exit(1);
+// port_registered runs on JACK's notification thread, where we can't make server requests,
+// so it only queues the port for the connector.
+void port_registered(jack_port_id_t id, int registered, void *arg) {
+	struct registration r = {id, registered};
+
+	if (jack_ringbuffer_write_space(registrations) < sizeof(r)) {
+		atomic_store(&registrations_lost, 1);
+	} else {
+		jack_ringbuffer_write(registrations, (const char *) &r, sizeof(r));
+	}
+	sem_post(&connector_wake);
 }
 
-int process(jack_nframes_t nframes, void *arg) {
-	int rc = 0;
-	
-	// Initialize the input buffers.
-	void *clkin = jack_port_get_buffer(mclk_input, nframes);
-	void *lpin = jack_port_get_buffer(launchpad_input, nframes);
-	void *ndin = jack_port_get_buffer(norddrum_input, nframes);
-	
-	// Buffer for data we will send to the nord drum.
-	void *lpout = jack_port_get_buffer(launchpad_output, nframes);
-	void *ndout = jack_port_get_buffer(norddrum_output, nframes);
+void *connector_thread(void *arg) {
+	struct registration r;
 
-	// Clear the output buffer.
-	jack_midi_clear_buffer(lpout);
-	jack_midi_clear_buffer(ndout);
+	while (1) {
+		sem_wait(&connector_wake);
 
-	// Process the input events.
-	jack_nframes_t nclk = jack_midi_get_event_count(clkin);
-	jack_nframes_t nlp = jack_midi_get_event_count(lpin);
-	jack_nframes_t nnd = jack_midi_get_event_count(ndin);
+		while (jack_ringbuffer_read_space(registrations) >= sizeof(r)) {
+			jack_ringbuffer_read(registrations, (char *) &r, sizeof(r));
 
-	if (nclk == 0 && nlp == 0 && nnd == 0) {
-		// If we didn't get any events then clear the output bus(ses). Is this necessary?
-		rc = jack_midi_event_write(ndout, 0, NULL, 0);
-		if (rc != 0) {
-			fprintf(stderr, "error writing data to nord drum\n");
-			return rc;
+			if (r.registered) {
+				jack_port_t *port = jack_port_by_id(client, r.id);
+				if (port != NULL) {
+					connect_port(jack_port_name(port));
+				}
+				continue;
+			}
+			// The port is already gone, so drop whichever peers went with it.
+			drop_lost_peers();
 		}
-		rc = jack_midi_event_write(lpout, 0, NULL, 0);
-		if (rc != 0) {
-			fprintf(stderr, "error writing data to launchpad\n");
-			return rc;
+		if (atomic_exchange(&registrations_lost, 0)) {
+			drop_lost_peers();
+			connect_ports();
 		}
 	}
-	// Process the launchpad events.
-	for (jack_nframes_t i = 0; i < nlp; i++) {
-		jack_midi_event_t midi_event;
-		
-		rc = jack_midi_event_get(&midi_event, lpin, (uint32_t) i);
-		if (rc != 0) {
-			fprintf(stderr, "error getting launchpad MIDI event\n");
-			return rc;
-		}
-		rc = handle_launchpad_event(midi_event, ndout, lpout);
-		if (rc != 0) {
-			fprintf(stderr, "error handling launchpad MIDI event\n");
-			return rc;
+	return NULL;
+}
+
+void drop_lost_peers() {
+	for (size_t i = 0; i < LINKS; i++) {
+		struct link *l = &links[i];
+
+		if (l->peer[0] != '\0' && !jack_port_connected_to(*l->port, l->peer)) {
+			fprintf(stderr, "lost %s\n", l->peer);
+			l->peer[0] = '\0';
 		}
 	}
-	if (norddrum_events == NULL) {
-		fprintf(stderr, "allocating array of nord drum MIDI events");
+}
+
+int set_pattern(const char *arg) {
+	const char *eq = strchr(arg, '=');
+	int found = 0;
+
+	if (eq == NULL || eq[1] == '\0') {
 		return 1;
 	}
-	// Process the nord drum events.
-	// This will store MIDI CC data for the current step.
-	// If we handle the nord drum before the clk events this means that
-	// when recording controller data we should try to tweak the controller just ahead of the trigs.
-	/* for (jack_nframes_t i = 0; i < nnd; i++) { */
-	/* 	jack_midi_event_t *midi_event = malloc(sizeof(jack_midi_event_t)); */
+	for (size_t i = 0; i < LINKS; i++) {
+		if (strlen(links[i].name) == (size_t) (eq - arg) && strncmp(links[i].name, arg, eq - arg) == 0) {
+			snprintf(links[i].pattern, sizeof(links[i].pattern), "%s", eq + 1);
+			found = 1;
+		}
+	}
+	return !found;
+}
 
-	/* 	rc = jack_midi_event_get(midi_event, ndin, (uint32_t) i); */
-	/* 	if (rc != 0) { */
-	/* 		fprintf(stderr, "error getting nord drum MIDI event\n"); */
-	/* 		return rc; */
-	/* 	} */
-	/* 	size_t written = jack_ringbuffer_write(norddrum_events, (void *) midi_event, sizeof(jack_midi_event_t)); */
-		
-	/* 	if (written < sizeof(jack_midi_event_t)) { */
-	/* 		fprintf(stderr, "wrote less bytes than expected to norddrum_events ringbuffer\n"); */
-	/* 		return 1; */
-	/* 	} */
-	/* } */
-	// Process the clk events.
-	// This will move the sequencer's internal state forward!
-	for (jack_nframes_t i = 0; i < nclk; i++) {
-		jack_midi_event_t midi_event;
-		
-		rc = jack_midi_event_get(&midi_event, clkin, (uint32_t) i);
-		if (rc != 0) {
-			fprintf(stderr, "error getting jack_midi_clock MIDI event\n");
-			return rc;
+int set_route(const char *arg) {
+	int track, output, channel, note;
+	char end;
+
+	if (sscanf(arg, "%d=%d:%d:%d%c", &track, &output, &channel, &note, &end) != 4) {
+		return 1;
+	}
+	if (track < 1 || track > TRACKS || output < 1 || output > OUTPUTS_MAX || channel < 1 || channel > 16 || note < 0 || note > 127) {
+		return 1;
+	}
+	routes[track - 1] = (struct route) {output - 1, channel - 1, note};
+
+	return 0;
+}
+
+void map_channels() {
+	memset(channel_tracks, -1, sizeof(channel_tracks));
+
+	for (int i = TRACKS - 1; i >= 0; i--) {
+		if (routes[i].output == 0) {
+			channel_tracks[routes[i].channel] = i;
 		}
-		rc = handle_clk_event(midi_event, ndout, lpout);
-		if (rc != 0) {
-			fprintf(stderr, "error handling jack_midi_clock MIDI event\n");
-			return rc;
+	}
+}
+
+// read_patterns reads NAME=PATTERN lines from path. Blank lines and lines starting with # are skipped.
+int read_patterns(const char *path) {
+	char line[256];
+	int lineno = 0;
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0') {
+			continue;
+		}
+		if (set_pattern(line) != 0) {
+			fprintf(stderr, "%s:%d: expected NAME=PATTERN with NAME one of launchpad, clock or norddrum\n", path, lineno);
+			fclose(fp);
+			return 1;
 		}
 	}
+	fclose(fp);
+
 	return 0;
 }
 
-int handle_launchpad_event(jack_midi_event_t midi_event, void *ndout, void *lpout) {
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-f BANK] [-c FILE] [-p NAME=PATTERN]... [-o NAME]... [-m TRACK=OUTPUT:CHANNEL:NOTE]... [-j] [-q] [-t] [-b BPM] [-s SECONDS] [-u ADDRESS] [-B PERIODS [-r RECORDING] [-d]]\n", prog);
+	fprintf(stderr, "  -f BANK     pattern bank file (default ndseq.bank)\n");
+	fprintf(stderr, "  -c FILE     read NAME=PATTERN lines from FILE\n");
+	fprintf(stderr, "  -p NAME=PATTERN\n");
+	fprintf(stderr, "              connect to the ports whose names contain PATTERN for NAME, one of\n");
+	fprintf(stderr, "              launchpad (default Launchpad Mini), clock (jack_midi_clock)\n");
+	fprintf(stderr, "              or norddrum (Scarlett 6i6), or output2 and up for -o\n");
+	fprintf(stderr, "  -o NAME     add an output port called NAME, the first one added is output 2\n");
+	fprintf(stderr, "  -m TRACK=OUTPUT:CHANNEL:NOTE\n");
+	fprintf(stderr, "              play a track on another output, channel or note\n");
+	fprintf(stderr, "  -j          smooth out jitter on the MIDI clock input\n");
+	fprintf(stderr, "  -q          quantize pads recorded in live trig mode to the nearest step\n");
+	fprintf(stderr, "  -t          follow the JACK transport instead of MIDI clock\n");
+	fprintf(stderr, "  -b BPM      tempo for -t when there is no timebase master (default 120)\n");
+	fprintf(stderr, "  -s SECONDS  print process callback stats every SECONDS\n");
+	fprintf(stderr, "  -u ADDRESS  send steps and trigs to HOST:PORT over UDP, or to a UNIX socket path\n");
+	fprintf(stderr, "  -B PERIODS  run PERIODS periods offline without JACK and print how long they took\n");
+	fprintf(stderr, "  -r FILE     input recording for -B\n");
+	fprintf(stderr, "  -d          print the output of -B\n");
+}
+
+void die(const char *msg) {
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+int process(jack_nframes_t nframes, void *arg) {
 	int rc = 0;
+	uint64_t start_ns = now_ns();
+	uint64_t t = 0;
 
-	// Handy for looking at raw MIDI data.
-	/* print_midi_event("launchpad", midi_event); */
+	process_start_ns = start_ns;
+	uint64_t sections[SECTIONS] = {0};
 	
-	// We always expect at least 3 bytes.
-	if (midi_event.size < 3) {
-		fprintf(stderr, "expected at least 3 bytes in MIDI message\n");
-		return 1;
+	// Initialize the input buffers.
+	void *clkin = backend->port_buffer(mclk_input, nframes);
+	void *lpin = backend->port_buffer(launchpad_input, nframes);
+	void *ndin = backend->port_buffer(norddrum_input, nframes);
+	
+	// Buffers for data we will send to the launchpad and the outputs, ndout is the nord drum's.
+	void *lpout = backend->port_buffer(launchpad_output, nframes);
+
+	for (int i = 0; i < noutputs; i++) {
+		output_buffers[i] = backend->port_buffer(outputs[i], nframes);
+		backend->clear_buffer(output_buffers[i]);
 	}
-	// "Scene Launch" button.
-	if (midi_event.buffer[0] == 0xB0) {
-		rc = handle_scene_button(midi_event, ndout, lpout);
-		if (rc != 0) {
-			fprintf(stderr, "error switch modes\n");
+	void *ndout = output_buffers[0];
+
+	// Clear the output buffer.
+	backend->clear_buffer(lpout);
+
+	if (atomic_load_explicit(&quitting, memory_order_acquire)) {
+		if (!quit_sent) {
+			send_quit(lpout);
+			quit_sent = 1;
+			sem_post(&quit_done);
 		}
-		return rc;
+		return 0;
 	}
-	// "Letter" button.
-	if ((midi_event.buffer[1] & 0x08) == 8) {
-		rc = handle_letter_button(midi_event, ndout, lpout);
+
+	// Apply the commands other threads have posted since the last cycle.
+	t = now_ns();
+	apply_commands();
+	sections[SECTION_COMMANDS] += now_ns() - t;
+
+	// Process the input events.
+	jack_nframes_t nclk = backend->event_count(clkin);
+	jack_nframes_t nlp = backend->event_count(lpin);
+	jack_nframes_t nnd = backend->event_count(ndin);
+
+	stats_acc.events_in += nclk + nlp + nnd;
+
+	if (nclk == 0 && nlp == 0 && nnd == 0) {
+		// If we didn't get any events then clear the output bus(ses). Is this necessary?
+		rc = backend->event_write(ndout, 0, NULL, 0);
 		if (rc != 0) {
-			fprintf(stderr, "handle letter button\n");
+			rt_log("error writing data to nord drum\n");
 		}
-		return rc;
 	}
-	/* printf(">>> grid button\n"); */
-	rc = handle_grid_button(midi_event, ndout, lpout);
-	if (rc != 0) {
-		fprintf(stderr, "handle grid button\n");
-		return rc;
+	period_frame = backend->last_frame_time();
+	following_transport = 0;
+
+	// If the transport clock is rolling it takes the place of the clk input, whose events are ignored
+	// even in the periods that have no transport tick. Otherwise the clk input may go through the smoother.
+	int generated = 0;
+	int nticks = -1;
+
+	if (clock_source == CLOCK_TRANSPORT) {
+		nticks = transport_ticks(nframes);
+	}
+	if (nticks >= 0) {
+		nclk = nticks;
+		generated = CLOCK_TRANSPORT;
+		following_transport = 1;
+	} else if (clock_smooth) {
+		nclk = smooth_ticks(clkin, nclk, nframes);
+		generated = CLOCK_MIDI;
 	}
-	return 0;
-}
 
-int handle_grid_button(jack_midi_event_t midi_event, void *ndout, void *lpout) {
-	int rc = 0;
-	
-	switch (mode) {
-	case MODE_SEQUENCER:
-		/* printf(">>> sequencer mode\n"); */
-		
-		// Ignore button up events.
-		if (midi_event.buffer[0] == 0x80) {
-			return 0;
+	// Process the nord drum events.
+	// This will store MIDI CC data for the current step.
+	// If we handle the nord drum before the clk events this means that
+	// when recording controller data we should try to tweak the controller just ahead of the trigs.
+	t = now_ns();
+	for (jack_nframes_t i = 0; ctrl_record && i < nnd; i++) {
+		jack_midi_event_t midi_event;
+
+		rc = backend->event_get(&midi_event, ndin, (uint32_t) i);
+		if (rc != 0) {
+			rt_log("error getting nord drum MIDI event\n");
+			break;
 		}
-		// Toggle the sequencer step for the current track.
-		rc = toggle_seq_step(midi_event, lpout);
+		rc = queue_ctrl(midi_event);
 		if (rc != 0) {
-			fprintf(stderr, "toggling sequencer step\n");
-			return rc;
+			rt_log("norddrum_events is full, dropping CC\n");
+			break;
 		}
-		break;
-	case MODE_LIVE_TRIG:
-		rc = handle_live_trig(midi_event, ndout, lpout);
+	}
+	sections[SECTION_NORDDRUM] += now_ns() - t;
+
+	// Process the launchpad and clk events in the order they arrived in the period.
+	// JACK requires the events in an output buffer to be written in time order,
+	// and every output event is written at the frame offset of the input event that caused it,
+	// so we merge the two inputs by timestamp instead of draining one port and then the other.
+	// On a tie the launchpad goes first.
+	// Clk events move the sequencer's internal state forward!
+	// Errors are logged and the rest of the period carries on.
+	// We never return non-zero because that makes JACK drop the client.
+	jack_nframes_t ilp = 0;
+	jack_nframes_t iclk = 0;
+	jack_midi_event_t lp_event;
+	jack_midi_event_t clk_event;
+	jack_nframes_t led_time = 0; // Time of the last event, the LED's go out no earlier than that.
+
+	if (nlp > 0 && backend->event_get(&lp_event, lpin, 0) != 0) {
+		rt_log("error getting launchpad MIDI event\n");
+		nlp = 0;
+	}
+	if (nclk > 0 && get_clk_event(&clk_event, clkin, 0, generated) != 0) {
+		rt_log("error getting jack_midi_clock MIDI event\n");
+		nclk = 0;
+	}
+	while (ilp < nlp || iclk < nclk) {
+		int lp_next = ilp < nlp && (iclk >= nclk || lp_event.time <= clk_event.time);
+
+		// Send the scheduled events that are due before this one.
+		t = now_ns();
+		flush_pending(lp_next ? lp_event.time : clk_event.time);
+		sections[SECTION_CLK] += now_ns() - t;
+
+		if (lp_next) {
+			t = now_ns();
+			rc = handle_launchpad_event(lp_event, ndout, lpout);
+			if (rc != 0) {
+				rt_log("error handling launchpad MIDI event\n");
+			}
+			sections[SECTION_LAUNCHPAD] += now_ns() - t;
+			led_time = lp_event.time;
+
+			if (++ilp < nlp && backend->event_get(&lp_event, lpin, (uint32_t) ilp) != 0) {
+				rt_log("error getting launchpad MIDI event\n");
+				ilp = nlp;
+			}
+			continue;
+		}
+		t = now_ns();
+		if (generated == CLOCK_TRANSPORT) {
+			follow_transport(clock_events[iclk].tick);
+		}
+		rc = handle_clk_event(clk_event, ndout, lpout);
 		if (rc != 0) {
-			fprintf(stderr, "handle_grid_button handling live trig\n");
-			return rc;
+			rt_log("error handling jack_midi_clock MIDI event\n");
 		}
-		break;
+		sections[SECTION_CLK] += now_ns() - t;
+		led_time = clk_event.time;
+
+		if (++iclk < nclk && get_clk_event(&clk_event, clkin, (uint32_t) iclk, generated) != 0) {
+			rt_log("error getting jack_midi_clock MIDI event\n");
+			iclk = nclk;
+		}
+	}
+	t = now_ns();
+	flush_pending(nframes);
+	sections[SECTION_CLK] += now_ns() - t;
+
+	// The nord drum output is done. Queue the LED's that ended the period different from what the
+	// Launchpad shows, once, so a cell set several times in a period (playhead on and off at a fast
+	// tempo, a step toggled under it) costs one message at most, and then send as much of the queued
+	// LED traffic as we can afford.
+	t = now_ns();
+	flush_leds(led_time);
+	drain_launchpad(lpout);
+	sections[SECTION_LEDS] += now_ns() - t;
+
+	// Update the stats.
+	uint64_t end_ns = now_ns();
+
+	stats_acc.periods++;
+	stats_acc.period_ns = (uint64_t) nframes * 1000000000ULL / backend->sample_rate();
+	for (int i = 0; i < noutputs; i++) {
+		stats_acc.nd_bytes_out += bytes_written(output_buffers[i]);
+	}
+	stats_acc.lp_bytes_out += bytes_written(lpout);
+
+	if (end_ns - start_ns > stats_acc.process.max) {
+		memcpy(stats_acc.worst, sections, sizeof(sections));
 	}
+	add_timing(&stats_acc.process, end_ns - start_ns);
+	for (int i = 0; i < SECTIONS; i++) {
+		add_timing(&stats_acc.sections[i], sections[i]);
+	}
+	if (npending > stats_acc.pending_max) {
+		stats_acc.pending_max = npending;
+	}
+	if (note_offs_used > stats_acc.note_offs_max) {
+		stats_acc.note_offs_max = note_offs_used;
+	}
+	if (lp_queue_tail - lp_queue_head > stats_acc.lp_queue_max) {
+		stats_acc.lp_queue_max = lp_queue_tail - lp_queue_head;
+	}
+	if (jack_ringbuffer_read_space(norddrum_events) > stats_acc.norddrum_events_max) {
+		stats_acc.norddrum_events_max = jack_ringbuffer_read_space(norddrum_events);
+	}
+	if (jack_ringbuffer_read_space(log_events) > stats_acc.log_events_max) {
+		stats_acc.log_events_max = jack_ringbuffer_read_space(log_events);
+	}
+	if (jack_ringbuffer_read_space(commands) > stats_acc.commands_max) {
+		stats_acc.commands_max = jack_ringbuffer_read_space(commands);
+	}
+	stats_acc.bpm = 0;
+	if (clock_smooth && clock_dll.locked) {
+		stats_acc.bpm = 60.0 * backend->sample_rate() / (24 * clock_dll.e2);
+	}
+	if (end_ns - stats_window_start >= STATS_WINDOW_NS) {
+		publish_stats(end_ns);
+	}
+	return 0;
 }
 
-int handle_live_trig(jack_midi_event_t midi_event, void *ndout, void *lpout) {
+// handle_launchpad_event looks the button up in lp_keys and hands it to the handler for the current mode.
+int handle_launchpad_event(jack_midi_event_t midi_event, void *ndout, void *lpout) {
 	int rc = 0;
 
-	/* printf(">>> handle_live_trig track = %d, velocity = %d\n", (midi_event.buffer[1] % 8)+1, (112 - (midi_event.buffer[1] & 0xF0)) + 15); */
+	// Handy for looking at raw MIDI data.
+	/* print_midi_event("launchpad", midi_event); */
 	
-	unsigned char ndevent[3] = {midi_event.buffer[0] + (midi_event.buffer[1] % 8), 60, (112 - (midi_event.buffer[1] & 0xF0)) + 15};
-	unsigned char lpevent[3] = {midi_event.buffer[0], midi_event.buffer[1], color(3, 0)};
+	// We always expect at least 3 bytes.
+	if (midi_event.size < 3) {
+		rt_log("expected at least 3 bytes in MIDI message\n");
+		return 1;
+	}
+	struct key key = lp_keys[((midi_event.buffer[0] & 0xF0) == 0xB0 ? 128 : 0) + (midi_event.buffer[1] & 0x7F)];
 
-	rc = jack_midi_event_write(ndout, 0, ndevent, 3);
+	rc = lp_handlers[mode][key.kind](midi_event, key, ndout, lpout);
 	if (rc != 0) {
-		fprintf(stderr, "error writing midi data to nord drum\n");
-		return rc;
+		rt_log("error handling launchpad button\n");
 	}
-	rc = jack_midi_event_write(lpout, 0, lpevent, 3);
-	if (rc != 0) {
-		fprintf(stderr, "error writing midi data to nord drum\n");
-		return rc;
+	return rc;
+}
+
+// init_lp_keys fills in lp_keys. Anything not listed here is KEY_NONE.
+void init_lp_keys() {
+	memset(lp_keys, 0, sizeof(lp_keys));
+
+	for (int step = 0; step < PAGE_STEPS; step++) {
+		int row = step / 8;
+
+		lp_keys[cell(step)] = (struct key) {KEY_GRID, step, step % 8, (112 - 16 * row) + 15};
+	}
+	for (int letter = 0; letter < 8; letter++) {
+		lp_keys[16 * letter + 8] = (struct key) {KEY_LETTER, letter, 0, 0};
 	}
+	for (int button = 0; button < PAGE_TRACKS; button++) {
+		lp_keys[128 + 104 + button] = (struct key) {KEY_TRACK, button, 0, 0};
+	}
+	lp_keys[128 + 110] = (struct key) {KEY_MODE, 0, 0, 0};
+	lp_keys[128 + 111] = (struct key) {KEY_SHIFT, 0, 0, 0};
+}
+
+int handle_ignored(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
 	return 0;
 }
 
-int handle_letter_button(jack_midi_event_t midi_event, void *ndout, void *lpout) {
-	// TODO: what should A-H do?
+// handle_seq_step toggles the step under a grid button for the current track.
+int handle_seq_step(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
+	int step = step_page * PAGE_STEPS + key.index;
+
+	// Ignore button up events, which are note-offs or note-ons with velocity 0.
+	if (midi_event.buffer[0] != 0x90 || midi_event.buffer[2] == 0) {
+		return 0;
+	}
+	set_step(curr_track, step, !get_trig(pat, curr_track, step));
 	return 0;
 }
 
-int handle_scene_button(jack_midi_event_t midi_event, void *ndout, void *lpout) {
+
+// handle_live_trig plays a pad on the nord drum at the pad's own frame offset.
+// The note is written before anything else is done about the pad. The LED only changes led_frame,
+// the LED scheduler sends it after all the nord drum output for the period.
+// A note that doesn't fit is counted and logged but doesn't stop the LED from lighting.
+// The note is held until the pad is released, or the track plays another note. pad_tracks remembers
+// which track a pad played, so the release ends that note even if the track page has changed since.
+int handle_live_trig(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
 	int rc = 0;
+	int down = midi_event.buffer[0] == 0x90 && midi_event.buffer[2] > 0;
 
-	switch (midi_event.buffer[1] % 8) {
-	case 6:
-		// Switch modes on button down only.
-		if (midi_event.buffer[2] == 0) {
-			return 0;
+	int column = key.column;
+	int track = track_page * PAGE_TRACKS + column;
+
+	// The last two columns aren't tracks, and neither are the ones past the last track.
+	if (column >= PAGE_TRACKS || track >= TRACKS) {
+		track = -1;
+	}
+	if (down && track >= 0) {
+		struct midi_msg ndevent = {0x90 + routes[track].channel, routes[track].note, key.velocity};
+
+		rc = write_note(track, midi_event.time, ndevent, GATE_HELD);
+		if (rc == 0) {
+			pad_tracks[key.index] = track + 1;
 		}
-		rc = switch_mode(midi_event, ndout, lpout);
-		if (rc != 0) {
-			fprintf(stderr, "handle_scene_button switching mode\n");
-			return rc;
+		if (ctrl_record) {
+			record_trig(track, period_frame + midi_event.time, key.velocity);
 		}
-		break;
-	case 7:
-		// TODO: what will this button do?
-		break;
-	default:
-		// Switch tracks (doesn't do anything in live trig mode, but perhaps it should).
-		rc = handle_track_button(midi_event, ndout, lpout);
-		if (rc != 0) {
-			fprintf(stderr, "calling handle_track_button\n");
-			return rc;
+	} else if (!down && pad_tracks[key.index] != 0) {
+		track = pad_tracks[key.index] - 1;
+		pad_tracks[key.index] = 0;
+
+		// Unless the sequencer has ended it already.
+		if (track_held[track].status != 0) {
+			rc = write_note(track, midi_event.time, track_held[track], 0);
 		}
 	}
+	if (rc != 0) {
+		rt_log("error writing midi data to nord drum\n");
+		stats_acc.live_trig_drops++;
+	} else if (down) {
+		add_timing(&stats_acc.live_trig, now_ns() - process_start_ns);
+	}
+	// Light the pad while it is held down, if it plays a track.
+	if (down && track >= 0) {
+		set_led(LED_GRID + key.index, color(3, 0));
+	} else {
+		set_led(LED_GRID + key.index, 0);
+	}
+	return 0;
+}
+
+int handle_letter_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
+	int letter = key.index;
+
+	if (midi_event.buffer[0] != 0x90 || midi_event.buffer[2] == 0) {
+		return 0;
+	}
+	// Queue pattern A-H on button down, or pick a page with shift.
+	if (!shift) {
+		queue_pattern(letter);
+	} else if (letter < STEP_PAGES) {
+		set_step_page(letter);
+		shift_used = 1;
+	} else if (letter - STEP_PAGES < TRACK_PAGES) {
+		set_track_page(letter - STEP_PAGES);
+		shift_used = 1;
+	}
 	return 0;
 }
 
-int handle_track_button(jack_midi_event_t midi_event, void *ndout, void *lpout) {
+// Switches modes on button down only.
+int handle_mode_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
 	int rc = 0;
 
-	// Update internal state of the sequencer.
-	curr_track = midi_event.buffer[1] - 104;
-	
-	// Update the track buttons.
-	for (int i = 0; i < 6; i++) {
-		unsigned char e[3] = {0xB0, 104+i, 0};
-		if (i == curr_track) {
-			e[2] = color(3, 0);
-		}
-		rc = jack_midi_event_write(lpout, 0, e, 3);
-		if (rc != 0) {
-			fprintf(stderr, "handle_track_button updating track button\n");
-			return rc;
-		}
+	if (midi_event.buffer[2] == 0) {
+		return 0;
 	}
-	// Update the grid with the current track's sequencer data.
-	for (int i = 0; i < 64; i++) {
-		unsigned char e[3] = {0x90, get_cell_from(i), 0};
-		if (trigdata[curr_track][i]) {
-			e[2] = color(3, 0);
-		}
-		rc = jack_midi_event_write(lpout, 0, e, 3);
-		if (rc != 0) {
-			fprintf(stderr, "handle_track_button updating grid button\n");
-			return rc;
+	rc = switch_mode(midi_event, ndout, lpout);
+	if (rc != 0) {
+		rt_log("handle_mode_button switching mode\n");
+	}
+	return rc;
+}
+
+// Shift while held, arm/disarm CC recording when let go.
+int handle_shift_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
+	if (midi_event.buffer[2] != 0) {
+		shift = 1;
+		shift_used = 0;
+	} else if (shift) {
+		shift = 0;
+		if (!shift_used) {
+			toggle_ctrl_record();
 		}
 	}
 	return 0;
 }
 
+// Switch tracks (doesn't do anything in live trig mode, but perhaps it should).
+int handle_track_button(jack_midi_event_t midi_event, struct key key, void *ndout, void *lpout) {
+	int track = track_page * PAGE_TRACKS + key.index;
+
+	if (track < TRACKS) {
+		select_track(track);
+	}
+	return 0;
+}
+
 int handle_clk_event(jack_midi_event_t midi_event, void *ndout, void *lpout) {
 	int rc = 0;
 	
 	if (midi_event.size < 1) {
-		fprintf(stderr, "expected at least 1 bytes in MIDI message\n");
+		rt_log("expected at least 1 bytes in MIDI message\n");
 		return 1;
 	}
+	// Store the CC's that came in before this clock event on the step that plays next.
+	record_ctrl(period_frame + midi_event.time);
+
 	switch (midi_event.buffer[0]) {
 	case 0xF8: // tick
-		rc = tick(ndout, lpout);
+		rc = tick(midi_event.time, ndout, lpout);
 		if (rc != 0) {
-			fprintf(stderr, "error ticking sequencer\n");
+			rt_log("error ticking sequencer\n");
 			return rc;
 		}
 		break;
@@ -533,9 +1905,9 @@ int handle_clk_event(jack_midi_event_t midi_event, void *ndout, void *lpout) {
 		/* printf("clock start 0xFB\n"); */
 	case 0xFA: // start
 		/* printf("clock start 0xFA\n"); */
-		rc = start(ndout, lpout);
+		rc = start(midi_event.time, ndout, lpout);
 		if (rc != 0) {
-			fprintf(stderr, "error starting sequencer\n");
+			rt_log("error starting sequencer\n");
 			return rc;
 		}
 		break;
@@ -554,202 +1926,446 @@ int handle_clk_event(jack_midi_event_t midi_event, void *ndout, void *lpout) {
 	/* 	} */
 	/* 	printf("\n"); */
 	}
-	// Process queued nord drum events.
-	while (jack_ringbuffer_read_space(norddrum_events) >= sizeof(jack_midi_event_t)) {
-		jack_midi_event_t *ndevent = malloc(sizeof(jack_midi_event_t));
-		size_t bytes_read = jack_ringbuffer_read(norddrum_events, (char *) ndevent, sizeof(jack_midi_event_t));
-		if (bytes_read < sizeof(jack_midi_event_t)) {
-			fprintf(stderr, "handle_clk_event reading nord drum MIDI event: expected to read %ld bytes, actually read %ld\n", sizeof(jack_midi_event_t), bytes_read);
-			return 1;
+	return rc;
+}
+
+// transport_ticks works out the frame offsets of the MIDI clock ticks that fall in this period.
+// Returns -1 if the transport is not rolling, 0 if it is but no tick falls in this period.
+int transport_ticks(jack_nframes_t nframes) {
+	jack_position_t pos;
+	double bpm = clock_bpm;
+	double position; // In ticks, at the first frame of the period.
+
+	if (backend->transport_query(&pos) != JackTransportRolling || pos.frame_rate == 0) {
+		return -1;
+	}
+	if (pos.valid & JackPositionBBT) {
+		// BBT beats are taken to be quarter notes.
+		bpm = pos.beats_per_minute;
+		position = ((pos.bar - 1) * pos.beats_per_bar + (pos.beat - 1)) * 24;
+		position += pos.tick * 24 / pos.ticks_per_beat;
+	} else {
+		position = pos.frame * bpm * 24 / (60.0 * pos.frame_rate);
+	}
+	if (bpm <= 0) {
+		return -1;
+	}
+	double frames_per_tick = 60.0 * pos.frame_rate / (bpm * 24);
+	uint64_t tick = (uint64_t) position;
+	int n = 0;
+
+	// BBT ticks are whole numbers, so position can come out a little early and claim a tick that
+	// the last period already had. Unless the transport has moved, carry on after the last tick.
+	if (pos.frame == transport_next_frame && tick < transport_next) {
+		tick = transport_next;
+	}
+	transport_next_frame = pos.frame + nframes;
+
+	// Ticks land on the nearest frame. Rounding (rather than truncating) means a tick right on a period
+	// boundary is claimed by the same period no matter which side of it the floating point error falls on.
+	// Start from the tick before position, it may round up into this period.
+	for (; n < CLOCK_EVENTS_MAX; tick++) {
+		double offset = (tick - position) * frames_per_tick + 0.5;
+
+		if (offset < 0) {
+			continue;
 		}
-		free(ndevent);
+		if (offset >= nframes) {
+			break;
+		}
+		clock_events[n++] = (struct clock_event) {(jack_nframes_t) offset, clock_tick_data, 1, tick};
+		transport_next = tick + 1;
 	}
-	return rc;
+	return n;
 }
 
-int handle_norddrum_event(jack_midi_event_t event, void *ndout, void *lpout) {
-	print_midi_event("nord drum", event);
-	return 0;
+// follow_transport points the sequencer at the given transport tick, just before it is handled.
+void follow_transport(uint64_t tick) {
+	beat_clock = tick;
+
+	if (tick % 6 == 0) {
+		uint64_t step = tick / 6;
+
+		bar_step = step & (BAR_STEPS - 1);
+
+		for (int i = 0; i < TRACKS; i++) {
+			set_head(&heads, i, step % head(pat->lengths, i));
+		}
+	}
 }
 
-int start(void *ndout, void *lpout) {
-	curr = 0;
-	return play(curr, ndout, lpout);
+int get_clk_event(jack_midi_event_t *event, void *clkin, uint32_t i, int generated) {
+	if (!generated) {
+		return backend->event_get(event, clkin, i);
+	}
+	event->time = clock_events[i].time;
+	event->size = clock_events[i].size;
+	event->buffer = clock_events[i].buffer;
+
+	return 0;
 }
 
-// nudge_seq updates just the internal state of the sequencer.
-// It does not do any MIDI I/O!
-void nudge_seq() {
-	prev = curr;
-	curr++;
+void dll_update(struct dll *d, double t) {
+	if (d->locked) {
+		double e = t - d->t1;
 
-	if (curr >= 64) {
-		curr = 0;
+		if (e > d->e2 * DLL_RESYNC || e < -d->e2 * DLL_RESYNC) {
+			d->locked = 0;
+		} else {
+			double w = 2 * 3.14159265358979 * DLL_BANDWIDTH;
+
+			d->t1 += 1.4142135623731 * w * e + d->e2;
+			d->e2 += w * w * e;
+		}
+	} else if (d->received > 0 && t > d->prev) {
+		// Lock on the second tick, and again on the tick after the one that threw the loop out,
+		// which itself goes straight through.
+		d->e2 = t - d->prev;
+		d->t1 = t + d->e2;
+		d->locked = 1;
 	}
+	d->prev = t;
+	d->received++;
 }
 
-// play a sequencer step.
-// This function is only called in response to clock events.
-int play(int step, void *ndout, void *lpout) {
-	int rc = 0;
+// smooth_ticks copies the clk input events for this period into clock_events,
+// replacing the ticks with ticks at the frames the DLL predicts.
+int smooth_ticks(void *clkin, jack_nframes_t nclk, jack_nframes_t nframes) {
+	struct dll *d = &clock_dll;
+	jack_nframes_t last = 0;
+	int n = 0;
 
-	// Play the tracks for the given step.
-	for (int i = 0; i < 6; i++) {
-		unsigned char ndevent[3] = {0x90+i, 60, 127};
-		if (trigdata[i][curr]) {
-			rc = jack_midi_event_write(ndout, 0, ndevent, 3);
-			if (rc != 0) {
-				fprintf(stderr, "writing MIDI data to nord drum\n");
-				return rc;
+	for (jack_nframes_t i = 0; i <= nclk; i++) {
+		jack_midi_event_t midi_event;
+		jack_nframes_t until = nframes;
+
+		if (i < nclk) {
+			if (backend->event_get(&midi_event, clkin, (uint32_t) i) != 0) {
+				rt_log("error getting jack_midi_clock MIDI event\n");
+				nclk = i;
+			} else {
+				until = midi_event.time;
 			}
 		}
-	}
-	// If we are in live trig mode then clock events have no effect on the grid.
-	// Note that we still need to advance the sequencer though.
-	if (mode == MODE_LIVE_TRIG) {
-		nudge_seq();
-		return 0;
-	}
-	unsigned char lpevent[3] = {0x90, cell(curr), color(1, 1)};
+		// Hand out the predicted ticks that are due before this event.
+		// A tick that was predicted in an earlier period, or before an event that has already gone, goes now.
+		while (n < CLOCK_EVENTS_MAX && d->locked && d->received > 0 && d->emitted <= d->received) {
+			double due = d->t1 + ((double) d->emitted - (double) d->received) * d->e2 - period_frame + 0.5;
 
-	rc = jack_midi_event_write(lpout, 0, lpevent, 3);
-	if (rc != 0) {
-		fprintf(stderr, "play: writing MIDI data to launchpad\n");
-		return rc;
-	}
-	if (curr == 0 && 0 == prev) {
-		// First time we've ever started.
-		// Assume all the sequencer data is 0, so we don't need to turn any buttons off.
-		for (int i = 0; i < 64; i++) {
-			unsigned char e[3] = {0x80, cell(i), 0};
-			rc = jack_midi_event_write(lpout, 0, e, 8);
-			if (rc != 0) {
-				fprintf(stderr, "play: error turning off launchpad button\n");
-				return rc;
+			if (due >= until) {
+				break;
+			}
+			if (due > last) {
+				last = (jack_nframes_t) due;
 			}
+			clock_events[n++] = (struct clock_event) {last, clock_tick_data, 1, 0};
+			d->emitted++;
 		}
-	} else {
-		unsigned char prev_color = 0;
-		if (trigdata[curr_track][prev]) {
-			prev_color = color(3, 0);
+		if (i >= nclk || n >= CLOCK_EVENTS_MAX) {
+			break;
 		}
-		// Turn off prev.
-		/* printf(">>> cell(prev) = %d\n", cell(prev)); */
-		unsigned char e[3] = {0x90, cell(prev), prev_color};
-		rc = jack_midi_event_write(lpout, 0, e, 8);
-		if (rc != 0) {
-			fprintf(stderr, "error turning off launchpad button\n");
-			return rc;
+		if (midi_event.size < 1) {
+			continue;
+		}
+		switch (midi_event.buffer[0]) {
+		case 0xF8:
+			dll_update(d, (double) period_frame + midi_event.time);
+
+			// Pass it through if the loop isn't locked and we haven't already sent a predicted tick for it.
+			if (d->locked || d->emitted >= d->received) {
+				continue;
+			}
+			d->emitted++;
+			break;
+		case 0xFA:
+		case 0xFB:
+			// The next tick is the first one again. The tick period carries over.
+			d->received = 0;
+			d->emitted = 0;
+			break;
 		}
+		last = midi_event.time;
+		clock_events[n++] = (struct clock_event) {last, midi_event.buffer, midi_event.size, 0};
 	}
-	nudge_seq();
-	
+	return n;
+}
+
+int handle_norddrum_event(jack_midi_event_t event, void *ndout, void *lpout) {
+	print_midi_event("nord drum", event);
 	return 0;
 }
 
-int tick(void *ndout, void *lpout) {
+int start(jack_nframes_t time, void *ndout, void *lpout) {
+	heads = (struct heads) {{0}};
+	bar_step = 0;
+
+	// Songs start from the top too.
+	if (song != NULL) {
+		song_pos = 0;
+		enter_pattern(song->patterns[0], song->indices[0]);
+		song_left = pattern_steps(pat);
+	}
+	return play(time, ndout, lpout);
+}
+
+// nudge_seq updates just the internal state of the sequencer.
+// It does not do any MIDI I/O!
+void nudge_seq() {
+	heads = advance_heads(heads, pat->lengths);
+	bar_step = (bar_step + 1) & (BAR_STEPS - 1);
+
+	if (song != NULL) {
+		advance_song();
+	}
+	publish_playhead(heads);
+}
+
+// advance_song moves on to the next entry of the song when the current one has played through.
+void advance_song() {
+	if (song_pos < 0) {
+		if (bar_step != 0) {
+			return;
+		}
+	} else if (--song_left > 0) {
+		return;
+	}
+	if (++song_pos >= song->count) {
+		song_pos = 0;
+	}
+	enter_pattern(song->patterns[song_pos], song->indices[song_pos]);
+	song_left = pattern_steps(pat);
+}
+
+int head(struct heads h, int track) {
+	return (h.w[track / 4] >> (16 * (track % 4))) & 0xFFFF;
+}
+
+void set_head(struct heads *h, int track, int step) {
+	int shift = 16 * (track % 4);
+
+	h->w[track / 4] &= ~(0xFFFFULL << shift);
+	h->w[track / 4] |= (uint64_t) step << shift;
+}
+
+// advance_heads adds one to every playhead and wraps the ones that reach their track's length back to 0.
+// It works on four lanes at once (SIMD within a register). Every lane is below 2^15, so or'ing in the
+// top bit of each lane and subtracting the lengths never borrows from the next lane, and leaves a lane's
+// top bit set exactly when its playhead has reached its length. Those bits are spread into lane masks
+// that clear the playheads that wrap.
+struct heads advance_heads(struct heads h, struct heads lengths) {
+	const uint64_t high = 0x8000800080008000ULL;
+
+	for (int i = 0; i < HEAD_WORDS; i++) {
+		uint64_t next = h.w[i] + HEADS_ONES;
+		uint64_t wrap = (((next | high) - lengths.w[i]) & high) >> 15;
+
+		h.w[i] = next & ~(wrap * 0xFFFF);
+	}
+	return h;
+}
+
+int same_heads(struct heads a, struct heads b) {
+	return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+int lined_up(struct heads h) {
+	uint64_t first = (h.w[0] & 0xFFFF) * HEADS_ONES;
+
+	for (int i = 0; i < HEAD_WORDS; i++) {
+		if (h.w[i] != first) {
+			return -1;
+		}
+	}
+	return h.w[0] & 0xFFFF;
+}
+
+void publish_playhead(struct heads h) {
+	atomic_fetch_add_explicit(&render_playhead_seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	render_playhead = h;
+	atomic_fetch_add_explicit(&render_playhead_seq, 1, memory_order_release);
+}
+
+struct heads read_playhead() {
+	struct heads h;
+	unsigned int seq;
+
+	do {
+		seq = atomic_load_explicit(&render_playhead_seq, memory_order_acquire);
+		h = render_playhead;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) != 0 || seq != atomic_load_explicit(&render_playhead_seq, memory_order_relaxed));
+
+	return h;
+}
+
+// play a sequencer step.
+// This function is only called in response to clock events.
+int play(jack_nframes_t time, void *ndout, void *lpout) {
+	int rc = 0;
+	struct rendered_step r;
+
+	switch_pattern();
+
+	// Use the step the render worker prepared, or render it now if it isn't ready.
+	if (take_rendered(heads, &r) != 0) {
+		render_step(pat, heads, &r);
+		atomic_fetch_add_explicit(&render_epoch, 1, memory_order_release);
+		stats_acc.render_misses++;
+	}
+	jack_nframes_t frame = period_frame + time;
+
+	measure_step(frame);
+	tap(frame, TAP_STEP, pattern_index, bar_step);
+
+	for (int i = 0; i < r.count; i++) {
+		int track = r.track[i];
+
+		if (r.chance[i] < 100 && !roll(track, r.chance[i])) {
+			continue;
+		}
+		// The pad was just hit for this step.
+		if ((overdub_skip & (1 << track)) != 0 && (r.msgs[i].status & 0xF0) == 0x90) {
+			continue;
+		}
+		// The gate is a share of the time until the next repeat (or step).
+		double spacing = step_frames / r.ratchet[i];
+		jack_nframes_t gate = 0;
+
+		if ((r.msgs[i].status & 0xF0) == 0x90) {
+			gate = (jack_nframes_t) (spacing * pat->gates[track] / 100) + 1;
+		}
+		if (r.delay[i] == 0 && r.ratchet[i] <= 1) {
+			// Keep going if the buffer is full, the sequencer still has to advance.
+			rc = write_note(track, time, r.msgs[i], gate);
+			if (rc != 0) {
+				rt_log("writing MIDI data to output\n");
+			}
+			continue;
+		}
+		// Spread the repeats evenly over the step, starting from the micro-timing offset.
+		double offset = step_frames * r.delay[i] / 100;
+
+		for (int k = 0; k < r.ratchet[i]; k++) {
+			if (schedule_msg(frame + (jack_nframes_t) (offset + k * spacing), track, r.msgs[i], gate) != 0) {
+				rt_log("too many scheduled events, dropping one\n");
+				stats_acc.pending_drops++;
+				break;
+			}
+		}
+	}
+	overdub_skip = 0;
+	// If we are in live trig mode then clock events have no effect on the grid.
+	// Note that we still need to advance the sequencer though.
+	if (mode == MODE_LIVE_TRIG) {
+		nudge_seq();
+		return 0;
+	}
+	// Move the playhead to the current track's step, if it is on the page we're showing.
+	int step = head(heads, curr_track) - step_page * PAGE_STEPS;
+
+	if (step < 0 || step >= PAGE_STEPS) {
+		step = -1;
+	}
+	// Restore the step that was lit to the current track's sequencer data.
+	if (lit >= 0 && lit != step) {
+		unsigned char prev_color = 0;
+		if (get_trig(pat, curr_track, step_page * PAGE_STEPS + lit)) {
+			prev_color = color(3, 0);
+		}
+		set_led(LED_GRID + lit, prev_color);
+	}
+	if (step >= 0) {
+		set_led(LED_GRID + step, color(1, 1));
+	}
+	lit = step;
+
+	nudge_seq();
+	
+	return 0;
+}
+
+int tick(jack_nframes_t time, void *ndout, void *lpout) {
 	if (beat_clock % 6 == 0) {
 		beat_clock++;
-		return play(curr, ndout, lpout);
+		return play(time, ndout, lpout);
 	}
 	beat_clock++;
 	return 0;
 }
 
-int reset_launchpad(void *lpout) {
-	int rc = 0;
-	
-	unsigned char lpevent[3] = {176, 0, 0};
-	
-	rc = jack_midi_event_write(lpout, 0, lpevent, 3);
-	if (rc != 0) {
-		fprintf(stderr, "resetting launchpad\n");
-		return rc;
+int reset_launchpad(jack_nframes_t time) {
+	if (lp_queue_space() < 1) {
+		rt_log("resetting launchpad\n");
+		return 1;
 	}
+	lp_enqueue(time, lp_reset());
+
+	// Every LED is off now, and the Launchpad is displaying and updating buffer 0.
+	memset(led_frame, 0, sizeof(led_frame));
+	memset(led_shadow, 0, sizeof(led_shadow));
+	lp_buffer = 0;
+
 	return 0;
 }
 
-int update_launchpad(void *lpout) {
-	int rc = 0;
-
-	unsigned char lpevent[3] = {176, 110, 0};
-	
+void update_launchpad() {
 	// Set the mode LED.
 	switch (mode) {
 	case MODE_LIVE_TRIG:
 		// Turn off the grid buttons.
-		for (int i = 0; i < 64; i++) {
-			unsigned char e[3] = {0x90, get_cell_from(i), 0};
-			rc = jack_midi_event_write(lpout, 0, e, 3);
-			if (rc != 0) {
-				fprintf(stderr, "update_launchpad turning grid button off\n");
-				return rc;
-			}
+		for (int i = 0; i < PAGE_STEPS; i++) {
+			set_led(LED_GRID + i, 0);
 		}
 		// Turn off the track buttons.
-		for (int i = 0; i < 6; i++) {
-			unsigned char e[3] = {0xB0, 104+i, 0};
-			rc = jack_midi_event_write(lpout, 0, e, 3);
-			if (rc != 0) {
-				fprintf(stderr, "update_launchpad turning track button off\n");
-				return rc;
-			}
+		for (int i = 0; i < PAGE_TRACKS; i++) {
+			set_led(LED_SCENE + i, 0);
 		}
-		lpevent[2] = color(3, 0); // g, r
+		set_led(LED_SCENE + 6, color(3, 0)); // g, r
 		break;
 	case MODE_SEQUENCER:
 		// If we're in sequencer mode then scene buttons 1-6 indicate the currently selected sequencer track.
-		rc = set_track_leds(lpout);
-		if (rc != 0) {
-			fprintf(stderr, "update_launchpad set track LED's\n");
-			return rc;
-		}
+		set_track_leds();
+
 		// Set the grid based on the sequencer data of the current track.
-		rc = set_grid_leds(lpout);
-		if (rc != 0) {
-			fprintf(stderr, "update_launchpad setting grid\n");
-			return rc;
-		}
-		lpevent[2] = color(3, 3); // g, r
+		set_grid_leds();
+
+		set_led(LED_SCENE + 6, color(3, 3)); // g, r
 		break;
 	}
-	rc = jack_midi_event_write(lpout, 0, lpevent, 3);
-	if (rc != 0) {
-		fprintf(stderr, "updating launchpad button\n");
-		return rc;
-	}
-	return 0;
+	set_pattern_leds();
 }
 
 // Initializes the sequencer.
-int initialize_seq(void *lpout) {
-	int rc = 0;
+int initialize_seq(jack_nframes_t time) {
+	init_lp_keys();
 
-	// Initialize sequencer data to be all zeroes.
-	for (int i = 0; i < 6; i++) {
-		for (int j = 0; j < 64; j++) {
-			trigdata[i][j] = 0;
-		}
-	}
+	// The sequencer data comes from the bank, start on its first pattern.
+	pat = &bank[0];
+	atomic_store_explicit(&render_pattern, pat, memory_order_release);
+	pattern_index = 0;
+	pattern_queued = -1;
 
+	// Seed the random number generators differently every run, except when benchmarking.
+	// xorshift needs a state that isn't 0.
+	uint32_t seed = bench_periods > 0 ? BENCH_SEED : (uint32_t) now_ns();
+
+	for (int i = 0; i < TRACKS; i++) {
+		rng[i] = (seed + 0x9E3779B9u * (i + 1)) | 1;
+	}
 	// Default to having the first track selected.
 	curr_track = 0;
 	
 	// Button 7 toggles between live trig and sequencer mode. Default is sequencer.
 	mode = MODE_SEQUENCER;
-	
-	rc = update_launchpad(lpout);
-	if (rc != 0) {
-		fprintf(stderr, "error updating launchpad\n");
-		return rc;
-	}
-	return 0;
-}
 
-// get the sequencer step from a MIDI event.
-// This event should be a grid button on the launchpad.
-int get_step_from(jack_midi_event_t midi_event) {
-	return (midi_event.buffer[1] % 8) + ((midi_event.buffer[1] & 0xF0) / 2);
+	// Don't record until asked to.
+	ctrl_record = 0;
+
+	update_launchpad();
+	flush_leds(time);
+
+	return 0;
 }
 
 // get_cell_from gets the MIDI Note value that indicates a cell in the grid based on a step value.
@@ -757,91 +2373,1893 @@ unsigned char get_cell_from(int step) {
 	return (16 * (step / 8)) + (step % 8);
 }
 
-// toggle a sequencer step based on the push of a grid button.
-// Note that we assume this is a "button down" event.
-int toggle_seq_step(jack_midi_event_t midi_event, void *lpout) {
-	int rc = 0;
-	int step = get_step_from(midi_event);
-	int val = trigdata[curr_track][step];
-
-	// Set the internal state of the sequencer.
-	trigdata[curr_track][step] = !val;
-
-	unsigned char e[3] = {midi_event.buffer[0], midi_event.buffer[1], color(0, 0)};
+void set_grid_leds() {
+	// The playhead gets drawn again on the next step.
+	lit = -1;
 
-	if (trigdata[curr_track][step]) {
-		e[2] = color(3, 0);
-	}
-	rc = jack_midi_event_write(lpout, 0, e, 3);
-	if (rc != 0) {
-		fprintf(stderr, "toggling sequencer step\n");
-		return rc;
+	for (int i = 0; i < PAGE_STEPS; i++) {
+		if (get_trig(pat, curr_track, step_page * PAGE_STEPS + i)) {
+			set_led(LED_GRID + i, color(3, 0));
+		} else {
+			set_led(LED_GRID + i, 0);
+		}
 	}
-	return 0;
 }
 
-int set_grid_leds(void *lpout) {
-	int rc = 0;
-	
-	for (int i = 0; i < 64; i++) {
-		unsigned char e[3] = {0x90, get_cell_from(i), 0};
-		if (trigdata[curr_track][i]) {
-			e[2] = color(3, 0);
-		}
-		rc = jack_midi_event_write(lpout, 0, e, 3);
-		if (rc != 0) {
-			fprintf(stderr, "set_grid_leds sending MIDI data to launchpad\n");
-			return rc;
+// Sets the track LED's based on the internal sequencer data (curr_track).
+void set_track_leds() {
+	for (int i = 0; i < PAGE_TRACKS; i++) {
+		if (track_page * PAGE_TRACKS + i == curr_track) {
+			set_led(LED_SCENE + i, color(3, 0));
+		} else {
+			set_led(LED_SCENE + i, 0);
 		}
 	}
-	return 0;
 }
 
-// Sets the track LED's based on the internal sequencer data (curr_track).
-int set_track_leds(void *lpout) {
-	int rc = 0;
-	
-	for (int i = 0; i < 6; i++) {
-		unsigned char lpevent[3] = {0xB0, i+104, 0x00};
-	
-		if (i == curr_track) {
-			lpevent[2] = color(3, 0);
-		}
-		rc = jack_midi_event_write(lpout, 0, lpevent, 3);
-		if (rc != 0) {
-			fprintf(stderr, "setting track LED %d\n", i);
-			return rc;
+// Sets the letter button LED's: green for the pattern that is playing, amber for the queued one.
+void set_pattern_leds() {
+	for (int i = 0; i < 8; i++) {
+		if (i == pattern_queued) {
+			set_led(LED_LETTER + i, color(3, 3));
+		} else if (i == pattern_index) {
+			set_led(LED_LETTER + i, color(3, 0));
+		} else {
+			set_led(LED_LETTER + i, 0);
 		}
 	}
-	return 0;
 }
 
 // Switches launchpad "modes".
 int switch_mode(jack_midi_event_t midi_event, void *ndout, void *lpout) {
-	int rc = 0;
-	
 	switch (mode) {
 	case MODE_LIVE_TRIG:
-		mode = MODE_SEQUENCER;
+		set_mode(MODE_SEQUENCER);
 		break;
 	case MODE_SEQUENCER:
-		mode = MODE_LIVE_TRIG;
+		set_mode(MODE_LIVE_TRIG);
 		break;
 	}
-	rc = update_launchpad(lpout);
-	if (rc != 0) {
-		fprintf(stderr, "switch_mode updating launchpad\n");
-		return rc;
+	return 0;
+}
+
+void set_mode(int m) {
+	mode = m;
+
+	update_launchpad();
+	redraw_leds();
+}
+
+void select_track(int track) {
+	// Update internal state of the sequencer.
+	curr_track = track;
+
+	// Track buttons don't show anything in live trig mode.
+	if (mode != MODE_SEQUENCER) {
+		return;
+	}
+	// Update the track buttons.
+	set_track_leds();
+
+	// Update the grid with the current track's sequencer data.
+	set_grid_leds();
+
+	// The whole grid changes, so flip to it in one go.
+	redraw_leds();
+}
+
+void set_step(int track, int step, int value) {
+	set_trig(pat, track, step, value);
+
+	if (mode != MODE_SEQUENCER || track != curr_track || step / PAGE_STEPS != step_page) {
+		return;
+	}
+	if (value) {
+		set_led(LED_GRID + step % PAGE_STEPS, color(3, 0));
+	} else {
+		set_led(LED_GRID + step % PAGE_STEPS, color(0, 0));
+	}
+}
+
+void set_step_page(int page) {
+	step_page = page;
+
+	if (mode == MODE_SEQUENCER) {
+		set_grid_leds();
+	}
+}
+
+void set_track_page(int page) {
+	track_page = page;
+
+	if (mode == MODE_SEQUENCER) {
+		set_track_leds();
+	}
+}
+
+// set_led sets the color of a Launchpad LED.
+// Nothing is sent to the Launchpad until the next call to flush_leds.
+void set_led(int led, unsigned char color) {
+	led_frame[led] = color;
+
+	if (!led_is_dirty[led]) {
+		led_is_dirty[led] = 1;
+		led_dirty[led_ndirty++] = (unsigned char) led;
+	}
+}
+
+void redraw_leds() {
+	led_redraw = 1;
+}
+
+// flush_leds queues the LED's that have changed since the last flush.
+// If the queue fills up the LED's that were not queued stay dirty for the next flush.
+void flush_leds(jack_nframes_t time) {
+	int i = 0;
+
+	// Redraw the page if that is cheaper than sending the changes one by one.
+	if (!led_redraw) {
+		int changed = 0;
+
+		for (int j = 0; j < led_ndirty; j++) {
+			changed += led_frame[led_dirty[j]] != led_shadow[led_dirty[j]];
+		}
+		if (changed > LED_RAPID_MESSAGES) {
+			led_redraw = 1;
+		}
+	}
+	if (led_redraw) {
+		flush_leds_rapid(time);
+		return;
+	}
+	for (; i < led_ndirty && lp_queue_space() > 0; i++) {
+		int led = led_dirty[i];
+
+		led_is_dirty[led] = 0;
+
+		if (led_frame[led] == led_shadow[led]) {
+			continue;
+		}
+		lp_enqueue(time, lp_led(led, led_frame[led]));
+		led_shadow[led] = led_frame[led];
 	}
+	// Keep whatever we did not get to.
+	memmove(led_dirty, led_dirty + i, led_ndirty - i);
+	led_ndirty -= i;
+}
+
+// flush_leds_rapid queues every LED into the hidden buffer and then displays it.
+// The page is queued all at once or not at all, if there isn't room led_redraw stays set for the next flush.
+// Nothing else can be queued in between, which matters because any message other than a rapid update
+// resets the rapid update cursor to the first grid button.
+void flush_leds_rapid(jack_nframes_t time) {
+	int hidden = !lp_buffer;
+
+	if (lp_queue_space() < LED_RAPID_MESSAGES) {
+		return;
+	}
+	// Keep displaying the current buffer, send updates to the hidden one.
+	lp_enqueue(time, lp_buffers(lp_buffer, hidden));
+
+	for (int led = 0; led < LED_COUNT; led += 2) {
+		lp_enqueue(time, lp_rapid(led_frame[led], led_frame[led+1]));
+	}
+	// Display and update the buffer we just wrote.
+	// Nothing needs to be copied since the next redraw overwrites the other buffer completely.
+	lp_enqueue(time, lp_buffers(hidden, hidden));
+
+	lp_buffer = hidden;
+
+	memcpy(led_shadow, led_frame, sizeof(led_shadow));
+	for (int i = 0; i < led_ndirty; i++) {
+		led_is_dirty[led_dirty[i]] = 0;
+	}
+	led_ndirty = 0;
+	led_redraw = 0;
+}
+
+size_t bytes_written(void *port_buffer) {
+	uint32_t n = backend->event_count(port_buffer);
+	size_t bytes = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		jack_midi_event_t e;
+
+		if (backend->event_get(&e, port_buffer, i) == 0) {
+			bytes += e.size;
+		}
+	}
+	return bytes;
+}
+
+int write_msg(void *port_buffer, jack_nframes_t time, struct midi_msg msg) {
+	jack_midi_data_t *data = backend->event_reserve(port_buffer, time, MIDI_MSG_SIZE);
+
+	if (data == NULL) {
+		return 1;
+	}
+	data[0] = msg.status;
+	data[1] = msg.data1;
+	data[2] = msg.data2;
+
 	return 0;
 }
 
-inline unsigned char cell(int step) {
-	return (unsigned char) (16 * (step / 8)) + (step % 8);
+struct midi_msg lp_led(int led, unsigned char color) {
+	// Scene buttons are CC's, the grid and letter buttons are notes.
+	if (led >= LED_SCENE) {
+		return (struct midi_msg) {0xB0, 104 + (led - LED_SCENE), color};
+	}
+	if (led >= LED_LETTER) {
+		return (struct midi_msg) {0x90, (16 * (led - LED_LETTER)) + 8, color};
+	}
+	return (struct midi_msg) {0x90, cell(led - LED_GRID), color};
 }
 
-inline unsigned char color(int g, int r) {
-	return (unsigned char) (g * 16) + r;
+struct midi_msg lp_rapid(unsigned char first, unsigned char second) {
+	return (struct midi_msg) {0x92, first, second};
+}
+
+// The double-buffering control byte is 0 0 1 C F U 0 D (Copy, Flash, Update buffer, Display buffer).
+struct midi_msg lp_buffers(int display, int update) {
+	return (struct midi_msg) {0xB0, 0, 0x20 | (update << 2) | display};
+}
+
+struct midi_msg lp_reset() {
+	return (struct midi_msg) {0xB0, 0, 0};
+}
+
+unsigned int lp_queue_space() {
+	return LP_QUEUE_MAX - (lp_queue_tail - lp_queue_head);
+}
+
+void lp_enqueue(jack_nframes_t time, struct midi_msg msg) {
+	struct lp_message *m = &lp_queue[lp_queue_tail & (LP_QUEUE_MAX - 1)];
+
+	m->time = time;
+	m->msg = msg;
+	lp_queue_tail++;
+}
+
+// drain_launchpad writes queued messages to the launchpad output buffer until the period's budget is spent.
+void drain_launchpad(void *lpout) {
+	size_t budget = backend->max_event_size(lpout) / 2;
+
+	if (budget > LP_BYTES_PER_PERIOD) {
+		budget = LP_BYTES_PER_PERIOD;
+	}
+	while (lp_queue_head != lp_queue_tail && budget >= MIDI_MSG_SIZE) {
+		struct lp_message *m = &lp_queue[lp_queue_head & (LP_QUEUE_MAX - 1)];
+
+		// Messages left over from an earlier period are already late, send them right away.
+		jack_nframes_t time = m->time;
+		if (lp_queue_late > 0) {
+			time = 0;
+		}
+		if (write_msg(lpout, time, m->msg) != 0) {
+			break;
+		}
+		if (lp_queue_late > 0) {
+			lp_queue_late--;
+		}
+		lp_queue_head++;
+		budget -= MIDI_MSG_SIZE;
+	}
+	lp_queue_late = lp_queue_tail - lp_queue_head;
+}
+
+// render_step builds the messages for a step.
+// The recorded CC's go first so the trigs on the same frame play with them.
+// Only the tracks that have a trig are visited, lowest track first.
+void render_step(const struct pattern *p, struct heads h, struct rendered_step *r) {
+	int step = lined_up(h);
+	unsigned int locked = 0;
+	unsigned int voices = 0;
+	int n = 0;
+
+	if (step >= 0) {
+		// The tracks are lined up, one load gets all of them.
+		locked = p->ctrlsteps[step];
+		voices = p->steps[step];
+	} else {
+		for (int i = 0; i < TRACKS; i++) {
+			int s = head(h, i);
+
+			locked |= p->ctrlsteps[s] & (1 << i);
+			voices |= ((p->trigs[i][s / 64] >> (s % 64)) & 1) << i;
+		}
+	}
+	while (locked != 0) {
+		int i = __builtin_ctz(locked);
+		const struct lock *l = p->ctrldata[i][head(h, i)];
+
+		locked &= locked - 1;
+
+		for (int j = 0; j < LOCKS_PER_STEP && l[j].cc != LOCK_EMPTY; j++) {
+			r->msgs[n] = (struct midi_msg) {0xB0 + routes[i].channel, l[j].cc, l[j].value};
+			r->chance[n] = 100;
+			r->delay[n] = 0;
+			r->ratchet[n] = 1;
+			r->track[n++] = i;
+		}
+	}
+	while (voices != 0) {
+		int i = __builtin_ctz(voices);
+		int s = head(h, i);
+		unsigned char velocity = p->velocity[i][s];
+
+		voices &= voices - 1;
+
+		if ((p->accents[i][s / 64] >> (s % 64)) & 1) {
+			velocity = VELOCITY_ACCENT;
+		}
+		r->msgs[n] = (struct midi_msg) {0x90 + routes[i].channel, routes[i].note, velocity};
+		r->chance[n] = p->chance[i][s];
+		r->delay[n] = p->delay[i][s];
+		r->ratchet[n] = p->ratchet[i][s];
+		r->track[n++] = i;
+	}
+	r->count = n;
+}
+
+// pending_before returns non-zero if a should go out before b. Frame times wrap, so compare the difference.
+int pending_before(const struct pending_event *a, const struct pending_event *b) {
+	int32_t d = (int32_t) (a->frame - b->frame);
+
+	return d < 0 || (d == 0 && (int32_t) (a->seq - b->seq) < 0);
+}
+
+int schedule_msg(jack_nframes_t frame, int track, struct midi_msg msg, jack_nframes_t gate) {
+	if (npending == PENDING_MAX) {
+		return 1;
+	}
+	struct pending_event e = {frame, pending_seq++, gate, track, msg};
+	int i = npending++;
+
+	// Sift up.
+	while (i > 0 && pending_before(&e, &pending[(i - 1) / 2])) {
+		pending[i] = pending[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	pending[i] = e;
+
+	return 0;
+}
+
+void flush_pending(jack_nframes_t until) {
+	jack_nframes_t end = period_frame + until;
+
+	// After a long stall (or the first time round) the wheel can be more than a lap behind,
+	// or look far ahead if the frame time started out past 2^31 or wrapped.
+	// Send whatever is on it and catch up, rather than walking every slot of every lap.
+	// The wheel is never more than a slot ahead of the period it was last flushed in.
+	int32_t behind = (int32_t) (end - wheel_time);
+
+	if (behind > WHEEL_HORIZON || behind < -WHEEL_SLOT_FRAMES) {
+		for (int i = 0; note_offs_used > 0 && i < WHEEL_SLOTS; i++) {
+			wheel_time = (jack_nframes_t) i << WHEEL_SLOT_SHIFT;
+			expire_slot(0);
+		}
+		wheel_time = period_frame & ~(jack_nframes_t) (WHEEL_SLOT_FRAMES - 1);
+	}
+	// Send the scheduled events and the note-offs in time order.
+	while (1) {
+		jack_nframes_t slot_end = wheel_time + WHEEL_SLOT_FRAMES - 1;
+		int event_due = npending > 0 && (int32_t) (pending[0].frame - end) < 0;
+		int slot_due = (int32_t) (slot_end - end) < 0;
+
+		if (event_due && (!slot_due || (int32_t) (pending[0].frame - slot_end) <= 0)) {
+			struct pending_event e = pop_pending();
+
+			if (write_note(e.track, frame_offset(e.frame), e.msg, e.gate) != 0) {
+				rt_log("writing scheduled MIDI data to output\n");
+			}
+		} else if (slot_due) {
+			expire_slot(frame_offset(slot_end));
+			wheel_time += WHEEL_SLOT_FRAMES;
+		} else {
+			break;
+		}
+	}
+}
+
+struct pending_event pop_pending() {
+	struct pending_event top = pending[0];
+
+	// Move the last event down from the root.
+	struct pending_event e = pending[--npending];
+	int i = 0;
+
+	while (2 * i + 1 < npending) {
+		int child = 2 * i + 1;
+
+		if (child + 1 < npending && pending_before(&pending[child + 1], &pending[child])) {
+			child++;
+		}
+		if (!pending_before(&pending[child], &e)) {
+			break;
+		}
+		pending[i] = pending[child];
+		i = child;
+	}
+	pending[i] = e;
+
+	return top;
+}
+
+jack_nframes_t frame_offset(jack_nframes_t frame) {
+	int32_t offset = (int32_t) (frame - period_frame);
+
+	return offset < 0 ? 0 : (jack_nframes_t) offset;
+}
+
+// write_note writes a message from track to its output, taking care of note-offs.
+// A note-on first ends the track's last note if it is still on, and then gets a note-off gate frames later
+// (none if gate is 0, or when its note-off is written if gate is GATE_HELD). A note-off cancels the one that was waiting.
+// A note-off is only cancelled once the one that replaces it has been written.
+int write_note(int track, jack_nframes_t time, struct midi_msg msg, jack_nframes_t gate) {
+	void *out = output_buffers[routes[track].output];
+	int rc = 0;
+
+	switch (msg.status & 0xF0) {
+	case 0x90:
+		if (track_off[track] != 0 || track_held[track].status != 0) {
+			struct midi_msg off = track_off[track] != 0 ? note_offs[track_off[track] - 1].msg : track_held[track];
+
+			// If it doesn't fit the note-off stays where it was, so the last note still ends.
+			rc = write_msg(out, time, off);
+			if (rc != 0) {
+				return rc;
+			}
+			cancel_off(track);
+		}
+		rc = write_msg(out, time, msg);
+		if (rc == 0) {
+			tap(period_frame + time, TAP_TRIG, track, msg.data2);
+		}
+		if (rc == 0 && gate == GATE_HELD) {
+			track_held[track] = (struct midi_msg) {0x80 + (msg.status & 0x0F), msg.data1, 0};
+		} else if (rc == 0 && gate > 0) {
+			schedule_off(track, (struct midi_msg) {0x80 + (msg.status & 0x0F), msg.data1, 0}, period_frame + time + gate);
+		}
+		return rc;
+	case 0x80:
+		rc = write_msg(out, time, msg);
+		if (rc == 0) {
+			cancel_off(track);
+		}
+		return rc;
+	}
+	return write_msg(out, time, msg);
+}
+
+void schedule_off(int track, struct midi_msg msg, jack_nframes_t frame) {
+	int32_t d = (int32_t) (frame - wheel_time);
+	int n = note_offs_free;
+
+	if (n != 0) {
+		note_offs_free = note_offs[n - 1].next;
+	} else if (note_offs_fresh < NOTE_OFFS_MAX) {
+		n = ++note_offs_fresh;
+	} else {
+		rt_log("too many note-offs, dropping one\n");
+		stats_acc.note_off_drops++;
+		return;
+	}
+	if (d < 0) {
+		d = 0;
+	} else if (d >= WHEEL_HORIZON) {
+		d = WHEEL_HORIZON - 1;
+	}
+	int slot = ((wheel_time + d) >> WHEEL_SLOT_SHIFT) & (WHEEL_SLOTS - 1);
+
+	note_offs[n - 1].track = track;
+	note_offs[n - 1].msg = msg;
+	note_offs[n - 1].next = wheel[slot];
+	wheel[slot] = n;
+	track_off[track] = n;
+	note_offs_used++;
+}
+
+void cancel_off(int track) {
+	track_held[track].status = 0;
+
+	if (track_off[track] != 0) {
+		note_offs[track_off[track] - 1].track = -1;
+		track_off[track] = 0;
+	}
+}
+
+// expire_slot sends the note-offs in the slot at wheel_time and frees them.
+void expire_slot(jack_nframes_t time) {
+	int slot = (wheel_time >> WHEEL_SLOT_SHIFT) & (WHEEL_SLOTS - 1);
+
+	while (wheel[slot] != 0) {
+		int n = wheel[slot];
+		struct note_off *o = &note_offs[n - 1];
+
+		wheel[slot] = o->next;
+
+		if (o->track >= 0) {
+			track_off[o->track] = 0;
+			if (write_msg(output_buffers[routes[o->track].output], time, o->msg) != 0) {
+				rt_log("writing note-off to output\n");
+			}
+		}
+		o->next = note_offs_free;
+		note_offs_free = n;
+		note_offs_used--;
+	}
+}
+
+// measure_step keeps step_frames up to date with the clock. Gaps longer than a few seconds
+// (the clock was stopped) are ignored, and until there's a measurement the tempo is taken from clock_bpm.
+void measure_step(jack_nframes_t frame) {
+	jack_nframes_t rate = backend->sample_rate();
+	jack_nframes_t d = frame - last_step_frame;
+
+	if (last_step_frame != 0 && d > 0 && d < 4 * rate) {
+		step_frames = d;
+	} else if (step_frames == 0) {
+		step_frames = 60.0 * rate / (4 * clock_bpm);
+	}
+	last_step_frame = frame;
+}
+
+uint32_t xorshift(uint32_t *state) {
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+int roll(int track, int chance) {
+	// Scale to 0-99 with a multiply instead of a divide.
+	return (int) (((uint64_t) xorshift(&rng[track]) * 100) >> 32) < chance;
+}
+
+// take_rendered pops rendered steps until it finds a current one for the playheads h.
+int take_rendered(struct heads h, struct rendered_step *r) {
+	uint64_t generation = atomic_load_explicit(&pattern_generation, memory_order_relaxed);
+
+	while (jack_ringbuffer_read_space(rendered_steps) >= sizeof(*r)) {
+		jack_ringbuffer_read(rendered_steps, (char *) r, sizeof(*r));
+
+		if (same_heads(r->heads, h) && r->generation == generation) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// render_thread keeps rendered_steps filled with the steps after the playheads.
+// The pattern can change while a step is being rendered, in which case the generation changes
+// and the step is rendered again.
+// After starting over, the steps rendered before are still queued ahead of the new ones until play throws
+// them away, so the number of new steps still queued is the smaller of the queue length and the number rendered.
+void *render_thread(void *arg) {
+	struct render_worker w = {0};
+
+	while (1) {
+		render_ahead(&w);
+		usleep(RENDER_POLL_US);
+	}
+	return NULL;
+}
+
+// render_ahead is one pass of the render worker: it tops up rendered_steps and returns.
+void render_ahead(struct render_worker *w) {
+	int wanted = atomic_load_explicit(&bank_wanted, memory_order_acquire);
+
+	// Bring in the pattern that is about to play.
+	if (wanted != w->ready) {
+		lock_pattern(wanted);
+		w->ready = wanted;
+		atomic_store_explicit(&bank_ready, w->ready, memory_order_release);
+	}
+	// The pattern is read once, after the generation: a switch stores the pattern before it bumps the
+	// generation, so this pass renders at least the pattern of generation g, and a newer one means a newer g
+	// that throws the steps away.
+	uint64_t g = atomic_load_explicit(&pattern_generation, memory_order_acquire);
+	const struct pattern *p = atomic_load_explicit(&render_pattern, memory_order_acquire);
+	unsigned int e = atomic_load_explicit(&render_epoch, memory_order_acquire);
+	size_t queued = jack_ringbuffer_read_space(rendered_steps) / sizeof(struct rendered_step);
+
+	if (g != w->generation || e != w->epoch) {
+		w->generation = g;
+		w->epoch = e;
+		w->next = read_playhead();
+		w->rendered = 0;
+	}
+	if (w->rendered > queued) {
+		w->rendered = queued;
+	}
+	while (w->rendered < RENDER_AHEAD && jack_ringbuffer_write_space(rendered_steps) >= sizeof(struct rendered_step)) {
+		struct rendered_step r;
+
+		r.generation = g;
+		r.heads = w->next;
+		render_step(p, w->next, &r);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&pattern_generation, memory_order_relaxed) != g) {
+			break;
+		}
+		jack_ringbuffer_write(rendered_steps, (const char *) &r, sizeof(r));
+		w->next = advance_heads(w->next, p->lengths);
+		w->rendered++;
+	}
+}
+
+int get_trig(const struct pattern *p, int track, int step) {
+	return (p->trigs[track][step / 64] >> (step % 64)) & 1;
+}
+
+void set_trig(struct pattern *p, int track, int step, int value) {
+	if (value) {
+		p->trigs[track][step / 64] |= (uint64_t) 1 << (step % 64);
+		p->steps[step] |= 1 << track;
+	} else {
+		p->trigs[track][step / 64] &= ~((uint64_t) 1 << (step % 64));
+		p->steps[step] &= ~(1 << track);
+	}
+	touch_pattern(p);
+}
+
+// set_lock stores a CC on a step.
+// A CC that is already locked on the step gets the new value, otherwise it takes the first free slot.
+// If every slot is taken the last one is replaced.
+void set_lock(struct pattern *p, int track, int step, unsigned char cc, unsigned char value) {
+	struct lock *l = p->ctrldata[track][step];
+	int j = 0;
+
+	while (j < LOCKS_PER_STEP - 1 && l[j].cc != LOCK_EMPTY && l[j].cc != cc) {
+		j++;
+	}
+	l[j].cc = cc;
+	l[j].value = value;
+	p->ctrlsteps[step] |= 1 << track;
+	touch_pattern(p);
+}
+
+void set_length(struct pattern *p, int track, int length) {
+	set_head(&p->lengths, track, length);
+	touch_pattern(p);
+}
+
+void clear_pattern(struct pattern *p) {
+	memset(p, 0, sizeof(*p));
+	for (int i = 0; i < TRACKS; i++) {
+		clear_locks(p, i);
+		set_length(p, i, PAGE_STEPS);
+	}
+	memset(p->velocity, VELOCITY_DEFAULT, sizeof(p->velocity));
+	memset(p->chance, 100, sizeof(p->chance));
+	memset(p->ratchet, 1, sizeof(p->ratchet));
+	memset(p->gates, GATE_DEFAULT, sizeof(p->gates));
+}
+
+void set_accent(struct pattern *p, int track, int step, int value) {
+	if (value) {
+		p->accents[track][step / 64] |= (uint64_t) 1 << (step % 64);
+	} else {
+		p->accents[track][step / 64] &= ~((uint64_t) 1 << (step % 64));
+	}
+	touch_pattern(p);
+}
+
+void set_velocity(struct pattern *p, int track, int step, int velocity) {
+	p->velocity[track][step] = velocity;
+	touch_pattern(p);
+}
+
+void set_chance(struct pattern *p, int track, int step, int chance) {
+	p->chance[track][step] = chance;
+	touch_pattern(p);
+}
+
+void set_delay(struct pattern *p, int track, int step, int delay) {
+	p->delay[track][step] = delay;
+	touch_pattern(p);
+}
+
+void set_ratchet(struct pattern *p, int track, int step, int ratchet) {
+	p->ratchet[track][step] = ratchet;
+	touch_pattern(p);
+}
+
+void set_gate(struct pattern *p, int track, int gate) {
+	p->gates[track] = gate;
+	touch_pattern(p);
+}
+
+// open_bank maps the pattern bank file at path.
+// A missing or empty file becomes a bank of empty patterns, and so does one whose header never got written.
+// If bank_private is set the file is only read, and a missing one isn't created.
+int open_bank(const char *path) {
+	size_t size = BANK_SIZE;
+	struct stat st = {0};
+	int created = 0;
+
+	int fd = open(path, bank_private ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if (fd < 0 && !(bank_private && errno == ENOENT)) {
+		perror(path);
+		return 1;
+	}
+	if (fd >= 0 && fstat(fd, &st) != 0) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	if (st.st_size == 0) {
+		created = 1;
+	} else if ((size_t) st.st_size != size) {
+		fprintf(stderr, "%s: not a pattern bank (wrong size)\n", path);
+		close(fd);
+		return 1;
+	}
+	// A new bank is sized up front, the patterns are filled in by the first syncs.
+	if (created && !bank_private && ftruncate(fd, size) != 0) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	// Nothing is read here, the pages come in as they are touched.
+	// An empty file that is only being read has nothing to map.
+	struct bank_header *h;
+
+	if (created && bank_private) {
+		h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	if (h == MAP_FAILED) {
+		perror(path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	static const struct bank_header unwritten = {{0}};
+
+	if (!created && memcmp(h, &unwritten, sizeof(*h)) == 0) {
+		created = 1;
+	}
+	if (!created && (memcmp(h->magic, BANK_MAGIC, sizeof(h->magic)) != 0 || h->version != BANK_VERSION ||
+		h->patterns != BANK_PATTERNS || h->pattern_size != sizeof(struct pattern))) {
+		fprintf(stderr, "%s: not a pattern bank, or written by a different version\n", path);
+		close(fd);
+		munmap(h, size);
+		return 1;
+	}
+	bank = (struct pattern *) (h + 1);
+	pat = &bank[0]; // The render thread may start before the sequencer is initialized.
+	atomic_store_explicit(&render_pattern, pat, memory_order_release);
+
+	if (created) {
+		memcpy(h->magic, BANK_MAGIC, sizeof(h->magic));
+		h->version = BANK_VERSION;
+		h->patterns = BANK_PATTERNS;
+		h->pattern_size = sizeof(struct pattern);
+
+		// This is the one time the whole bank is touched. clear_pattern marks every pattern,
+		// so the bank thread writes them all out, and only then the header.
+		for (int i = 0; i < BANK_PATTERNS; i++) {
+			clear_pattern(&bank[i]);
+		}
+	}
+	if (bank_private) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	} else {
+		bank_fd = fd;
+		bank_new = created;
+	}
+	// The first pattern plays straight away.
+	lock_pattern(0);
+	atomic_store(&bank_wanted, 0);
+	atomic_store(&bank_ready, 0);
+
+	return 0;
+}
+
+// sync_bank writes the patterns that were edited since the last sync back to the file.
+// A private bank has nowhere to go.
+int sync_bank() {
+	int rc = 0;
+	int written = 0;
+
+	if (bank_fd < 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&bank_lock);
+	for (int w = 0; w < BANK_PATTERNS / 32; w++) {
+		unsigned int dirty = atomic_exchange_explicit(&bank_dirty[w], 0, memory_order_acquire);
+
+		while (dirty != 0) {
+			int i = 32 * w + __builtin_ctz(dirty);
+			off_t offset = sizeof(struct bank_header) + (off_t) i * sizeof(struct pattern);
+
+			dirty &= dirty - 1;
+
+			// An edit while this is being written marks the pattern again, so it can't be lost.
+			if (pwrite_all(bank_fd, &bank[i], sizeof(struct pattern), offset) != 0) {
+				perror(bank_path);
+				atomic_fetch_or_explicit(&bank_dirty[w], 1u << (i % 32), memory_order_relaxed);
+				rc = 1;
+				continue;
+			}
+			written++;
+		}
+	}
+	if (written > 0 && fdatasync(bank_fd) != 0) {
+		perror(bank_path);
+		rc = 1;
+	}
+	// A bank that is cut short before this gets created again the next time, instead of read as garbage.
+	if (rc == 0 && bank_new) {
+		if (pwrite_all(bank_fd, (struct bank_header *) bank - 1, sizeof(struct bank_header), 0) != 0 ||
+			fdatasync(bank_fd) != 0) {
+			perror(bank_path);
+			rc = 1;
+		} else {
+			bank_new = 0;
+		}
+	}
+	pthread_mutex_unlock(&bank_lock);
+
+	return rc;
+}
+
+void *bank_thread(void *arg) {
+	while (1) {
+		sleep(BANK_SYNC_SECONDS);
+		sync_bank();
+	}
+	return NULL;
+}
+
+void touch_pattern(struct pattern *p) {
+	ptrdiff_t i = p - bank;
+
+	if (bank != NULL && i >= 0 && i < BANK_PATTERNS) {
+		atomic_fetch_or_explicit(&bank_dirty[i / 32], 1u << (i % 32), memory_order_release);
+	}
+	atomic_fetch_add_explicit(&pattern_generation, 1, memory_order_release);
+}
+
+int pwrite_all(int fd, const void *buf, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t n = pwrite(fd, buf, size, offset);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		buf = (const char *) buf + n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+void lock_pattern(int index) {
+	if (mlock(&bank[index], sizeof(struct pattern)) != 0) {
+		// Not fatal, but the process thread may now have to fault the pattern in when it plays or edits it.
+		perror("locking pattern");
+	}
+}
+
+void queue_pattern(int index) {
+	song = NULL;
+
+	if (index == pattern_index) {
+		pattern_queued = -1;
+	} else {
+		pattern_queued = index;
+		atomic_store_explicit(&bank_wanted, index, memory_order_release);
+	}
+	set_pattern_leds();
+}
+
+void switch_pattern() {
+	if (pattern_queued < 0 || bar_step != 0 || atomic_load_explicit(&bank_ready, memory_order_acquire) != pattern_queued) {
+		return;
+	}
+	enter_pattern(&bank[pattern_queued], pattern_queued);
+}
+
+void enter_pattern(struct pattern *p, int index) {
+	pat = p;
+	pattern_index = index;
+	pattern_queued = -1;
+	atomic_store_explicit(&render_pattern, p, memory_order_release);
+	atomic_fetch_add_explicit(&pattern_generation, 1, memory_order_release);
+
+	// The new pattern starts from the top, unless the transport says where we are.
+	if (!following_transport) {
+		heads = (struct heads) {{0}};
+	}
+	set_pattern_leds();
+	if (mode == MODE_SEQUENCER) {
+		set_grid_leds();
+		redraw_leds();
+	}
+}
+
+int pattern_steps(const struct pattern *p) {
+	int steps = 1;
+
+	for (int i = 0; i < TRACKS; i++) {
+		int length = head(p->lengths, i);
+
+		if (length > steps) {
+			steps = length;
+		}
+	}
+	return steps;
+}
+
+// compile_song parses a song like "1x4 2 3x2" (pattern 1 four times, pattern 2 once, then pattern 3 twice)
+// into s, and locks its patterns into memory. It runs on the console thread.
+int compile_song(struct song *s, char *text) {
+	char *save = NULL;
+	int count = 0;
+
+	for (char *word = strtok_r(text, " \t\n", &save); word != NULL; word = strtok_r(NULL, " \t\n", &save)) {
+		int index = 0;
+		int repeats = 1;
+
+		if (sscanf(word, "%dx%d", &index, &repeats) < 1 || index < 1 || index > BANK_PATTERNS || repeats < 1) {
+			fprintf(stderr, "bad song entry: %s\n", word);
+			return 1;
+		}
+		if (count + repeats > SONG_MAX) {
+			fprintf(stderr, "songs can have at most %d patterns\n", SONG_MAX);
+			return 1;
+		}
+		lock_pattern(index - 1);
+
+		for (int i = 0; i < repeats; i++, count++) {
+			s->patterns[count] = &bank[index - 1];
+			s->indices[count] = index - 1;
+		}
+	}
+	if (count == 0) {
+		fprintf(stderr, "empty song\n");
+		return 1;
+	}
+	s->count = count;
+
+	return 0;
+}
+
+void clear_locks(struct pattern *p, int track) {
+	for (int i = 0; i < STEPS; i++) {
+		for (int j = 0; j < LOCKS_PER_STEP; j++) {
+			p->ctrldata[track][i][j].cc = LOCK_EMPTY;
+			p->ctrldata[track][i][j].value = 0;
+		}
+		p->ctrlsteps[i] &= ~(1 << track);
+	}
+	touch_pattern(p);
+}
+
+// queue_ctrl copies a nord drum CC into norddrum_events.
+// Anything that isn't a CC on a channel a track is routed to (see channel_tracks) is ignored.
+int queue_ctrl(jack_midi_event_t midi_event) {
+	jack_ringbuffer_data_t vec[2];
+
+	if (midi_event.size != 3 || (midi_event.buffer[0] & 0xF0) != 0xB0) {
+		return 0;
+	}
+	int track = channel_tracks[midi_event.buffer[0] & 0x0F];
+
+	if (track < 0) {
+		return 0;
+	}
+	jack_ringbuffer_get_write_vector(norddrum_events, vec);
+	if (vec[0].len < sizeof(struct nd_record)) {
+		return 1;
+	}
+	struct nd_record *r = (struct nd_record *) vec[0].buf;
+
+	r->frame = period_frame + midi_event.time;
+	r->status = midi_event.buffer[0];
+	r->data1 = midi_event.buffer[1];
+	r->data2 = midi_event.buffer[2];
+	r->track = track;
+	jack_ringbuffer_write_advance(norddrum_events, sizeof(struct nd_record));
+
+	return 0;
+}
+
+void record_ctrl(jack_nframes_t frame) {
+	jack_ringbuffer_data_t vec[2];
+
+	while (1) {
+		jack_ringbuffer_get_read_vector(norddrum_events, vec);
+		if (vec[0].len < sizeof(struct nd_record)) {
+			return;
+		}
+		struct nd_record *r = (struct nd_record *) vec[0].buf;
+
+		// Frame times wrap around, so compare the difference.
+		if ((int32_t) (r->frame - frame) > 0) {
+			return;
+		}
+		set_lock(pat, r->track, head(heads, r->track), r->data1, r->data2);
+		jack_ringbuffer_read_advance(norddrum_events, sizeof(struct nd_record));
+	}
+}
+
+// record_trig stores a pad hit at frame time frame on the step that was playing then.
+// Nothing is recorded until the sequencer has played a step, or if the clock has stopped.
+void record_trig(int track, jack_nframes_t frame, int velocity) {
+	if (last_step_frame == 0 || step_frames == 0) {
+		return;
+	}
+	// How far into the step the hit is, in steps. The step that is playing is the one before heads.
+	double pos = (int32_t) (frame - last_step_frame) / step_frames;
+	int step = head(heads, track) - 1;
+
+	if (step < 0) {
+		step = head(pat->lengths, track) - 1;
+	}
+	if (pos < 0) {
+		pos = 0;
+	}
+	if (pos >= 2) {
+		return;
+	}
+	if (record_quantize) {
+		pos = (int) (pos + 0.5);
+	}
+	if (pos >= 1) {
+		step = head(heads, track);
+		pos -= 1;
+		overdub_skip |= 1 << track;
+	}
+	int delay = (int) (pos * 100);
+
+	if (delay > 99) {
+		delay = 99;
+	}
+	set_step(track, step, 1);
+	set_velocity(pat, track, step, velocity);
+	set_delay(pat, track, step, delay);
+}
+
+void toggle_ctrl_record() {
+	ctrl_record = !ctrl_record;
+
+	if (ctrl_record) {
+		set_led(LED_SCENE + 7, color(0, 3));
+	} else {
+		set_led(LED_SCENE + 7, 0);
+		// Forget whatever is still queued.
+		jack_ringbuffer_read_advance(norddrum_events, jack_ringbuffer_read_space(norddrum_events));
+	}
+}
+
+inline unsigned char cell(int step) {
+	return (unsigned char) (16 * (step / 8)) + (step % 8);
+}
+
+inline unsigned char color(int g, int r) {
+	return (unsigned char) (g * 16) + r;
+}
+
+void tap(jack_nframes_t frame, int type, int track, int value) {
+	struct tap_record r = {frame, type, track, value};
+
+	if (tap_events == NULL) {
+		return;
+	}
+	if (jack_ringbuffer_write_space(tap_events) < sizeof(r)) {
+		atomic_fetch_add_explicit(&tap_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	jack_ringbuffer_write(tap_events, (const char *) &r, sizeof(r));
+}
+
+// open_tap connects a datagram socket to address. Anything starting with / is a UNIX socket.
+int open_tap(const char *address) {
+	if (address[0] == '/') {
+		struct sockaddr_un sun = {0};
+
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: path too long\n", address);
+			return -1;
+		}
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, address);
+
+		int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (fd < 0) {
+			perror(address);
+			return -1;
+		}
+		// The consumer may not be listening yet, datagrams sent until it is are lost.
+		if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0 && errno != ENOENT && errno != ECONNREFUSED) {
+			perror(address);
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	char host[256];
+	const char *port = strrchr(address, ':');
+
+	if (port == NULL || port == address || (size_t) (port - address) >= sizeof(host)) {
+		fprintf(stderr, "expected HOST:PORT or a path, not %s\n", address);
+		return -1;
+	}
+	memcpy(host, address, port - address);
+	host[port - address] = '\0';
+
+	struct addrinfo hints = {0};
+	struct addrinfo *res = NULL;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	int rc = getaddrinfo(host, port + 1, &hints, &res);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", address, gai_strerror(rc));
+		return -1;
+	}
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+		perror(address);
+		if (fd >= 0) {
+			close(fd);
+		}
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+// tap_thread sends what's in tap_events every TAP_INTERVAL_US, TAP_BATCH records to a datagram.
+// A UNIX socket that isn't there yet is connected again on the next send.
+void *tap_thread(void *arg) {
+	struct {
+		struct tap_header header;
+		struct tap_record records[TAP_BATCH];
+	} packet;
+	uint32_t sequence = 0;
+	unsigned long dropped = 0;
+
+	while (1) {
+		while (jack_ringbuffer_read_space(tap_events) >= sizeof(struct tap_record)) {
+			size_t n = jack_ringbuffer_read(tap_events, (char *) packet.records, sizeof(packet.records)) / sizeof(struct tap_record);
+
+			dropped += atomic_exchange_explicit(&tap_dropped, 0, memory_order_relaxed);
+			packet.header.sequence = sequence++;
+			packet.header.dropped = (uint32_t) dropped;
+
+			size_t size = sizeof(packet.header) + n * sizeof(struct tap_record);
+
+			if (send(tap_fd, &packet, size, 0) < 0 && tap_address[0] == '/' && (errno == ENOTCONN || errno == ECONNREFUSED || errno == ENOENT)) {
+				struct sockaddr_un sun = {0};
+
+				sun.sun_family = AF_UNIX;
+				strcpy(sun.sun_path, tap_address);
+				connect(tap_fd, (struct sockaddr *) &sun, sizeof(sun));
+			}
+		}
+		usleep(TAP_INTERVAL_US);
+	}
+	return NULL;
+}
+
+void rt_log(const char *msg) {
+	rt_logf(msg, 0, 0);
+}
+
+void rt_logf(const char *fmt, long a, long b) {
+	struct log_record r = {fmt, {a, b}};
+
+	if (jack_ringbuffer_write_space(log_events) < sizeof(r)) {
+		atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	jack_ringbuffer_write(log_events, (const char *) &r, sizeof(r));
+}
+
+int post_command(struct command cmd) {
+	int rc = 0;
+
+	pthread_mutex_lock(&commands_lock);
+	if (jack_ringbuffer_write_space(commands) < sizeof(cmd)) {
+		rc = 1;
+	} else {
+		jack_ringbuffer_write(commands, (const char *) &cmd, sizeof(cmd));
+	}
+	pthread_mutex_unlock(&commands_lock);
+
+	return rc;
+}
+
+void apply_commands() {
+	struct command cmd;
+
+	while (jack_ringbuffer_read_space(commands) >= sizeof(cmd)) {
+		jack_ringbuffer_read(commands, (char *) &cmd, sizeof(cmd));
+		apply_command(cmd);
+	}
+}
+
+void apply_command(struct command cmd) {
+	// post_command's callers validate their input, but a bad index here would corrupt memory.
+	if (cmd.track < 0 || cmd.track >= TRACKS || cmd.step < 0 || cmd.step >= STEPS) {
+		rt_log("apply_command: track or step out of range\n");
+		return;
+	}
+	switch (cmd.type) {
+	case CMD_INITIALIZE:
+		if (reset_launchpad(0) != 0) {
+			rt_log("failed to reset launchpad\n");
+		}
+		if (initialize_seq(0) != 0) {
+			rt_log("failed to initialize sequencer\n");
+		}
+		break;
+	case CMD_SET_MODE:
+		if (cmd.value != mode) {
+			set_mode(cmd.value);
+		}
+		break;
+	case CMD_SELECT_TRACK:
+		select_track(cmd.track);
+		break;
+	case CMD_SET_STEP:
+		set_step(cmd.track, cmd.step, cmd.value != 0);
+		break;
+	case CMD_CLEAR_TRACK:
+		for (int i = 0; i < STEPS; i++) {
+			set_step(cmd.track, i, 0);
+		}
+		clear_locks(pat, cmd.track);
+		for (int i = 0; i < STEPS; i++) {
+			set_accent(pat, cmd.track, i, 0);
+			set_velocity(pat, cmd.track, i, VELOCITY_DEFAULT);
+			set_chance(pat, cmd.track, i, 100);
+			set_delay(pat, cmd.track, i, 0);
+			set_ratchet(pat, cmd.track, i, 1);
+		}
+		set_gate(pat, cmd.track, GATE_DEFAULT);
+		break;
+	case CMD_SET_LENGTH:
+		if (cmd.value < 1 || cmd.value > STEPS) {
+			rt_log("apply_command: length out of range\n");
+			break;
+		}
+		set_length(pat, cmd.track, cmd.value);
+
+		// Don't let the playhead run past the new end.
+		if (head(heads, cmd.track) >= cmd.value) {
+			set_head(&heads, cmd.track, 0);
+		}
+		break;
+	case CMD_QUEUE_PATTERN:
+		if (cmd.value < 0 || cmd.value >= BANK_PATTERNS) {
+			rt_log("apply_command: pattern out of range\n");
+			break;
+		}
+		queue_pattern(cmd.value);
+		break;
+	case CMD_SET_ACCENT:
+		set_accent(pat, cmd.track, cmd.step, cmd.value != 0);
+		break;
+	case CMD_SET_VELOCITY:
+		if (cmd.value < 1 || cmd.value > 127) {
+			rt_log("apply_command: velocity out of range\n");
+			break;
+		}
+		set_velocity(pat, cmd.track, cmd.step, cmd.value);
+		break;
+	case CMD_SET_CHANCE:
+		if (cmd.value < 0 || cmd.value > 100) {
+			rt_log("apply_command: chance out of range\n");
+			break;
+		}
+		set_chance(pat, cmd.track, cmd.step, cmd.value);
+		break;
+	case CMD_SET_DELAY:
+		if (cmd.value < 0 || cmd.value > 99) {
+			rt_log("apply_command: delay out of range\n");
+			break;
+		}
+		set_delay(pat, cmd.track, cmd.step, cmd.value);
+		break;
+	case CMD_SET_RATCHET:
+		if (cmd.value < 1 || cmd.value > 8) {
+			rt_log("apply_command: ratchet out of range\n");
+			break;
+		}
+		set_ratchet(pat, cmd.track, cmd.step, cmd.value);
+		break;
+	case CMD_SET_GATE:
+		if (cmd.value < 1 || cmd.value > 100) {
+			rt_log("apply_command: gate out of range\n");
+			break;
+		}
+		set_gate(pat, cmd.track, cmd.value);
+		break;
+	case CMD_SET_SONG:
+		if (cmd.value < -1 || cmd.value > 1) {
+			rt_log("apply_command: song out of range\n");
+			break;
+		}
+		song = cmd.value < 0 ? NULL : &songs[cmd.value];
+		song_pos = -1;
+		pattern_queued = -1;
+		set_pattern_leds();
+		atomic_fetch_add_explicit(&song_serial, 1, memory_order_release);
+		break;
+	default:
+		rt_logf("apply_command: unknown command %ld\n", cmd.type, 0);
+	}
+}
+
+// console_thread reads one command per line from stdin:
+//
+//   mode live|seq
+//   track TRACK
+//   step TRACK STEP 0|1
+//   accent TRACK STEP 0|1
+//   velocity TRACK STEP 1-127
+//   chance TRACK STEP 0-100
+//   delay TRACK STEP 0-99         (percent of a step)
+//   ratchet TRACK STEP 1-8
+//   gate TRACK 1-100              (percent of a step or repeat)
+//   clear TRACK
+//   length TRACK 1-256
+//   pattern 1-128
+//   song [PATTERN[xREPEATS]]...   (no patterns leaves song mode)
+//
+// Tracks and steps are numbered from 1.
+void *console_thread(void *arg) {
+	char line[256];
+	int next_song = 0;
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		struct command cmd = {0};
+		char word[16];
+
+		if (sscanf(line, "%15s", word) != 1) {
+			continue;
+		}
+		if (strcmp(word, "song") == 0) {
+			unsigned int serial = atomic_load_explicit(&song_serial, memory_order_acquire);
+			char *rest = strstr(line, "song") + 4;
+
+			cmd.type = CMD_SET_SONG;
+			cmd.value = -1;
+			if (sscanf(rest, "%15s", word) == 1) {
+				if (compile_song(&songs[next_song], rest) != 0) {
+					continue;
+				}
+				cmd.value = next_song;
+			}
+			if (post_command(cmd) != 0) {
+				fprintf(stderr, "command queue is full\n");
+				continue;
+			}
+			// Wait until the process thread lets go of the other song.
+			while (atomic_load_explicit(&song_serial, memory_order_acquire) == serial) {
+				usleep(1000);
+			}
+			if (cmd.value >= 0) {
+				next_song = !next_song;
+			}
+			continue;
+		}
+		if (strcmp(word, "mode") == 0 && sscanf(line, "%*s %15s", word) == 1) {
+			cmd.type = CMD_SET_MODE;
+			if (strcmp(word, "live") == 0) {
+				cmd.value = MODE_LIVE_TRIG;
+			} else if (strcmp(word, "seq") == 0) {
+				cmd.value = MODE_SEQUENCER;
+			} else {
+				fprintf(stderr, "unknown mode: %s\n", word);
+				continue;
+			}
+		} else if (strcmp(word, "track") == 0 && sscanf(line, "%*s %d", &cmd.track) == 1) {
+			cmd.type = CMD_SELECT_TRACK;
+			cmd.track--;
+		} else if (strcmp(word, "step") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_STEP;
+			cmd.track--;
+			cmd.step--;
+		} else if (strcmp(word, "accent") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_ACCENT;
+			cmd.track--;
+			cmd.step--;
+		} else if (strcmp(word, "velocity") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_VELOCITY;
+			cmd.track--;
+			cmd.step--;
+			if (cmd.value < 1 || cmd.value > 127) {
+				fprintf(stderr, "velocity must be 1-127\n");
+				continue;
+			}
+		} else if (strcmp(word, "chance") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_CHANCE;
+			cmd.track--;
+			cmd.step--;
+			if (cmd.value < 0 || cmd.value > 100) {
+				fprintf(stderr, "chance must be 0-100\n");
+				continue;
+			}
+		} else if (strcmp(word, "delay") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_DELAY;
+			cmd.track--;
+			cmd.step--;
+			if (cmd.value < 0 || cmd.value > 99) {
+				fprintf(stderr, "delay must be 0-99\n");
+				continue;
+			}
+		} else if (strcmp(word, "ratchet") == 0 && sscanf(line, "%*s %d %d %d", &cmd.track, &cmd.step, &cmd.value) == 3) {
+			cmd.type = CMD_SET_RATCHET;
+			cmd.track--;
+			cmd.step--;
+			if (cmd.value < 1 || cmd.value > 8) {
+				fprintf(stderr, "ratchet must be 1-8\n");
+				continue;
+			}
+		} else if (strcmp(word, "gate") == 0 && sscanf(line, "%*s %d %d", &cmd.track, &cmd.value) == 2) {
+			cmd.type = CMD_SET_GATE;
+			cmd.track--;
+			if (cmd.value < 1 || cmd.value > 100) {
+				fprintf(stderr, "gate must be 1-100\n");
+				continue;
+			}
+		} else if (strcmp(word, "clear") == 0 && sscanf(line, "%*s %d", &cmd.track) == 1) {
+			cmd.type = CMD_CLEAR_TRACK;
+			cmd.track--;
+		} else if (strcmp(word, "pattern") == 0 && sscanf(line, "%*s %d", &cmd.value) == 1) {
+			cmd.type = CMD_QUEUE_PATTERN;
+			cmd.value--;
+			if (cmd.value < 0 || cmd.value >= BANK_PATTERNS) {
+				fprintf(stderr, "pattern must be 1-%d\n", BANK_PATTERNS);
+				continue;
+			}
+		} else if (strcmp(word, "length") == 0 && sscanf(line, "%*s %d %d", &cmd.track, &cmd.value) == 2) {
+			cmd.type = CMD_SET_LENGTH;
+			cmd.track--;
+			if (cmd.value < 1 || cmd.value > STEPS) {
+				fprintf(stderr, "length must be 1-%d\n", STEPS);
+				continue;
+			}
+		} else {
+			fprintf(stderr, "unknown command: %s", line);
+			continue;
+		}
+		if (cmd.track < 0 || cmd.track >= TRACKS || cmd.step < 0 || cmd.step >= STEPS) {
+			fprintf(stderr, "track must be 1-%d and step must be 1-%d\n", TRACKS, STEPS);
+			continue;
+		}
+		if (post_command(cmd) != 0) {
+			fprintf(stderr, "command queue is full\n");
+		}
+	}
+	return NULL;
+}
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void add_timing(struct timing *t, uint64_t ns) {
+	if (t->count == 0 || ns < t->min) {
+		t->min = ns;
+	}
+	if (ns > t->max) {
+		t->max = ns;
+	}
+	t->total += ns;
+	t->count++;
+}
+
+void publish_stats(uint64_t now) {
+	atomic_fetch_add_explicit(&stats_seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	stats_snapshot = stats_acc;
+	atomic_fetch_add_explicit(&stats_seq, 1, memory_order_release);
+
+	memset(&stats_acc, 0, sizeof(stats_acc));
+	stats_window_start = now;
+}
+
+int read_stats(struct stats *s) {
+	unsigned int seq;
+
+	do {
+		seq = atomic_load_explicit(&stats_seq, memory_order_acquire);
+		*s = stats_snapshot;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) != 0 || seq != atomic_load_explicit(&stats_seq, memory_order_relaxed));
+
+	return seq == 0;
+}
+
+int xrun(void *arg) {
+	atomic_fetch_add_explicit(&xruns, 1, memory_order_relaxed);
+	return 0;
+}
+
+void *stats_thread(void *arg) {
+	const char *names[SECTIONS] = {"commands", "nord drum", "launchpad", "clk", "leds"};
+	struct stats s;
+
+	while (1) {
+		sleep(stats_interval);
+
+		unsigned long n = atomic_exchange_explicit(&xruns, 0, memory_order_relaxed);
+		if (read_stats(&s) != 0 || s.periods == 0) {
+			continue;
+		}
+		fprintf(stderr, "process: %lu periods of %" PRIu64 " us, min/avg/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " us, %lu xruns\n",
+			s.periods, s.period_ns / 1000, s.process.min / 1000, s.process.total / s.process.count / 1000, s.process.max / 1000, n);
+		for (int i = 0; i < SECTIONS; i++) {
+			fprintf(stderr, "  %-10s min/avg/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " us, %" PRIu64 " us in the slowest period\n",
+				names[i], s.sections[i].min / 1000, s.sections[i].total / s.sections[i].count / 1000, s.sections[i].max / 1000, s.worst[i] / 1000);
+		}
+		if (s.bpm > 0) {
+			fprintf(stderr, "  clk input tempo %.2f BPM\n", s.bpm);
+		}
+		fprintf(stderr, "  %lu steps were not rendered ahead\n", s.render_misses);
+		if (s.live_trig.count > 0) {
+			jack_latency_range_t capture;
+			jack_latency_range_t playback;
+
+			// The note goes out at the pad's frame offset, so on top of the time it takes us to get to it
+			// a pad takes the latency of the launchpad input plus that of the nord drum output.
+			jack_port_get_latency_range(launchpad_input, JackCaptureLatency, &capture);
+			jack_port_get_latency_range(outputs[0], JackPlaybackLatency, &playback);
+
+			fprintf(stderr, "  %lu live trigs written min/avg/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " us into the period, %lu dropped\n",
+				s.live_trig.count, s.live_trig.min / 1000, s.live_trig.total / s.live_trig.count / 1000, s.live_trig.max / 1000, s.live_trig_drops);
+			fprintf(stderr, "  pad to note latency %u-%u frames (%.2f-%.2f ms)\n", capture.min + playback.min, capture.max + playback.max,
+				1000.0 * (capture.min + playback.min) / backend->sample_rate(), 1000.0 * (capture.max + playback.max) / backend->sample_rate());
+		}
+		fprintf(stderr, "  events in %lu, bytes out %lu to the nord drum and %lu to the launchpad\n", s.events_in, s.nd_bytes_out, s.lp_bytes_out);
+		fprintf(stderr, "  max queued: lp_queue %u/%d, norddrum_events %zu, log_events %zu, commands %zu bytes\n",
+			s.lp_queue_max, LP_QUEUE_MAX, s.norddrum_events_max, s.log_events_max, s.commands_max);
+		fprintf(stderr, "  max scheduled: %d/%d, %lu dropped\n", s.pending_max, PENDING_MAX, s.pending_drops);
+		fprintf(stderr, "  max note-offs: %d/%d, %lu dropped\n", s.note_offs_max, NOTE_OFFS_MAX, s.note_off_drops);
+	}
+	return NULL;
+}
+
+void *log_thread(void *arg) {
+	struct log_record r;
+
+	while (1) {
+		while (jack_ringbuffer_read_space(log_events) >= sizeof(r)) {
+			jack_ringbuffer_read(log_events, (char *) &r, sizeof(r));
+			fprintf(stderr, r.fmt, r.args[0], r.args[1]);
+		}
+		unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+		if (dropped > 0) {
+			fprintf(stderr, "dropped %lu log messages\n", dropped);
+		}
+		usleep(10000);
+	}
+	return NULL;
+}
+
+jack_nframes_t client_last_frame_time() {
+	return jack_last_frame_time(client);
+}
+
+jack_nframes_t client_sample_rate() {
+	return jack_get_sample_rate(client);
+}
+
+jack_transport_state_t client_transport_query(jack_position_t *pos) {
+	return jack_transport_query(client, pos);
+}
+
+// The fake ports are the fake_buffers themselves.
+void *fake_port_buffer(jack_port_t *port, jack_nframes_t nframes) {
+	return port;
+}
+
+uint32_t fake_event_count(void *buffer) {
+	return ((struct fake_buffer *) buffer)->count;
+}
+
+int fake_event_get(jack_midi_event_t *event, void *buffer, uint32_t i) {
+	struct fake_buffer *b = buffer;
+
+	if (i >= b->count) {
+		return -ENODATA;
+	}
+	*event = b->events[i];
+
+	return 0;
+}
+
+void fake_clear_buffer(void *buffer) {
+	struct fake_buffer *b = buffer;
+
+	b->count = 0;
+	b->used = 0;
+}
+
+int fake_event_write(void *buffer, jack_nframes_t time, const jack_midi_data_t *data, size_t size) {
+	jack_midi_data_t *p = fake_event_reserve(buffer, time, size);
+
+	if (p == NULL) {
+		return -ENOBUFS;
+	}
+	if (size > 0) {
+		memcpy(p, data, size);
+	}
+
+	return 0;
+}
+
+// Like JACK, events have to be written in time order.
+jack_midi_data_t *fake_event_reserve(void *buffer, jack_nframes_t time, size_t size) {
+	struct fake_buffer *b = buffer;
+
+	if (b->count == FAKE_EVENTS_MAX || size > sizeof(b->data) - b->used || time >= BENCH_NFRAMES) {
+		return NULL;
+	}
+	if (b->count > 0 && time < b->events[b->count - 1].time) {
+		return NULL;
+	}
+	jack_midi_event_t *e = &b->events[b->count++];
+
+	e->time = time;
+	e->size = size;
+	e->buffer = &b->data[b->used];
+	b->used += size;
+
+	return e->buffer;
+}
+
+size_t fake_max_event_size(void *buffer) {
+	struct fake_buffer *b = buffer;
+
+	return b->count == FAKE_EVENTS_MAX ? 0 : sizeof(b->data) - b->used;
+}
+
+jack_nframes_t fake_last_frame_time() {
+	return fake_frame;
+}
+
+jack_nframes_t fake_sample_rate() {
+	return fake_rate;
+}
+
+jack_transport_state_t fake_transport_query(jack_position_t *pos) {
+	memset(pos, 0, sizeof(*pos));
+
+	return JackTransportStopped;
+}
+
+int bench() {
+	const char *names[FAKE_PORTS] = {"clk", "lp", "nd", "lp", "nd", "out2", "out3", "out4"};
+	struct bench_event *events = NULL;
+	size_t nevents = 0;
+	int rc = 0;
+
+	backend = &fake_backend;
+	mclk_input = (jack_port_t *) &fake_buffers[FAKE_CLK_IN];
+	launchpad_input = (jack_port_t *) &fake_buffers[FAKE_LP_IN];
+	norddrum_input = (jack_port_t *) &fake_buffers[FAKE_ND_IN];
+	launchpad_output = (jack_port_t *) &fake_buffers[FAKE_LP_OUT];
+	for (int i = 0; i < noutputs; i++) {
+		outputs[i] = (jack_port_t *) &fake_buffers[FAKE_OUT + i];
+	}
+
+	if (bench_path != NULL) {
+		rc = load_recording(bench_path, &events, &nevents);
+		if (rc != 0) {
+			return rc;
+		}
+	} else {
+		// Start, and enter a beat on each track: select it, then press and release some pads.
+		struct bench_event e = {0, FAKE_CLK_IN, 0, 1, {0xFA}};
+
+		rc |= add_bench_event(&events, &nevents, e);
+		for (int t = 0; t < 6; t++) {
+			e = (struct bench_event) {0, FAKE_LP_IN, 0, 3, {0xB0, 104 + t, 0x7F}};
+			rc |= add_bench_event(&events, &nevents, e);
+
+			for (int s = t % 4; s < 64; s += 4 + t) {
+				int note = 16 * (s / 8) + s % 8;
+
+				e = (struct bench_event) {0, FAKE_LP_IN, 0, 3, {0x90, note, 0x7F}};
+				rc |= add_bench_event(&events, &nevents, e);
+				e = (struct bench_event) {0, FAKE_LP_IN, 0, 3, {0x80, note, 0}};
+				rc |= add_bench_event(&events, &nevents, e);
+			}
+		}
+		if (rc != 0) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	// Initialize on the first period, the same way the JACK client does.
+	if (post_command((struct command) {CMD_INITIALIZE, 0, 0, 0}) != 0) {
+		fprintf(stderr, "failed to queue initialization\n");
+		return 1;
+	}
+	// A recording loops, the synthetic clock just keeps going.
+	unsigned long length = nevents > 0 ? events[nevents - 1].period + 1 : 1;
+	double tick_frames = 60.0 * fake_rate / (24 * clock_bpm);
+	double next_tick = tick_frames;
+	size_t next = 0;
+	struct timing t = {0};
+	struct render_worker w = {0};
+	unsigned long misses = 0;
+	unsigned long bytes[FAKE_PORTS] = {0};
+	uint64_t hash = 0xCBF29CE484222325ULL; // FNV-1a.
+	uint64_t start_ns = now_ns();
+
+	for (unsigned long p = 0; p < bench_periods; p++) {
+		for (int i = 0; i < FAKE_PORTS; i++) {
+			fake_clear_buffer(&fake_buffers[i]);
+		}
+		if (p % length == 0) {
+			next = 0;
+		}
+		if (bench_path != NULL || p == 0) {
+			for (; next < nevents && events[next].period == p % length; next++) {
+				struct bench_event *e = &events[next];
+
+				if (fake_event_write(&fake_buffers[e->port], e->time, e->data, e->size) != 0) {
+					fprintf(stderr, "%s:%lu: event out of order, or too many in one period\n", names[e->port], e->period);
+				}
+			}
+		}
+		if (bench_path == NULL) {
+			for (; next_tick < BENCH_NFRAMES; next_tick += tick_frames) {
+				fake_event_write(&fake_buffers[FAKE_CLK_IN], (jack_nframes_t) next_tick, clock_tick_data, 1);
+			}
+			next_tick -= BENCH_NFRAMES;
+		}
+		// There is no render thread, render ahead between periods instead so play takes the same path.
+		render_ahead(&w);
+
+		unsigned long missed = stats_acc.render_misses;
+		uint64_t before = now_ns();
+
+		process(BENCH_NFRAMES, NULL);
+		add_timing(&t, now_ns() - before);
+
+		// The stats may have been published (and reset) at the end of the period.
+		misses += stats_acc.render_misses >= missed ? stats_acc.render_misses - missed : stats_snapshot.render_misses - missed;
+
+		for (int i = FAKE_LP_OUT; i < FAKE_OUT + noutputs; i++) {
+			struct fake_buffer *b = &fake_buffers[i];
+
+			for (uint32_t j = 0; j < b->count; j++) {
+				jack_midi_event_t *e = &b->events[j];
+
+				hash = (hash ^ (uint64_t) i) * 0x100000001B3ULL;
+				hash = (hash ^ ((uint64_t) fake_frame + e->time)) * 0x100000001B3ULL;
+				for (size_t k = 0; k < e->size; k++) {
+					hash = (hash ^ e->buffer[k]) * 0x100000001B3ULL;
+				}
+				if (bench_dump && e->size > 0) {
+					printf("%lu %s %u", p, names[i], e->time);
+					for (size_t k = 0; k < e->size; k++) {
+						printf(" %02X", e->buffer[k]);
+					}
+					printf("\n");
+				}
+			}
+			bytes[i] += b->used;
+		}
+		fake_frame += BENCH_NFRAMES;
+	}
+	double seconds = (now_ns() - start_ns) / 1e9;
+
+	fprintf(stderr, "%lu periods of %d frames in %.3f s, %.0f periods per second\n",
+		bench_periods, BENCH_NFRAMES, seconds, bench_periods / seconds);
+	fprintf(stderr, "  process min/avg/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " ns\n", t.min, t.total / t.count, t.max);
+	unsigned long out = 0;
+
+	for (int i = FAKE_OUT; i < FAKE_OUT + noutputs; i++) {
+		out += bytes[i];
+	}
+	fprintf(stderr, "  bytes out %lu to the outputs and %lu to the launchpad, %.2f per period\n",
+		out, bytes[FAKE_LP_OUT], (double) (out + bytes[FAKE_LP_OUT]) / bench_periods);
+	fprintf(stderr, "  %lu steps were not rendered ahead\n", misses);
+	fprintf(stderr, "  output hash %016" PRIx64 "\n", hash);
+
+	free(events);
+
+	return 0;
+}
+
+// load_recording reads the events of a recording, see bench.
+int load_recording(const char *path, struct bench_event **events, size_t *n) {
+	char line[256];
+	int lineno = 0;
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		struct bench_event e = {0};
+		char port[16];
+		unsigned int data[MIDI_MSG_SIZE];
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		int fields = sscanf(line, "%lu %15s %u %x %x %x", &e.period, port, &e.time, &data[0], &data[1], &data[2]);
+		if (fields < 4) {
+			fprintf(stderr, "%s:%d: expected PERIOD PORT OFFSET BYTE...\n", path, lineno);
+			fclose(fp);
+			return 1;
+		}
+		if (strcmp(port, "clk") == 0) {
+			e.port = FAKE_CLK_IN;
+		} else if (strcmp(port, "lp") == 0) {
+			e.port = FAKE_LP_IN;
+		} else if (strcmp(port, "nd") == 0) {
+			e.port = FAKE_ND_IN;
+		} else {
+			fprintf(stderr, "%s:%d: unknown port %s\n", path, lineno, port);
+			fclose(fp);
+			return 1;
+		}
+		if (*n > 0 && e.period < (*events)[*n - 1].period) {
+			fprintf(stderr, "%s:%d: periods have to be in order\n", path, lineno);
+			fclose(fp);
+			return 1;
+		}
+		e.size = fields - 3;
+		for (size_t i = 0; i < e.size; i++) {
+			e.data[i] = data[i];
+		}
+		if (add_bench_event(events, n, e) != 0) {
+			fprintf(stderr, "out of memory\n");
+			fclose(fp);
+			return 1;
+		}
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+int add_bench_event(struct bench_event **events, size_t *n, struct bench_event e) {
+	// Grow in powers of 2.
+	if ((*n & (*n - 1)) == 0) {
+		struct bench_event *p = realloc(*events, (*n == 0 ? 1 : 2 * *n) * sizeof(e));
+		if (p == NULL) {
+			return 1;
+		}
+		*events = p;
+	}
+	(*events)[(*n)++] = e;
+
+	return 0;
 }
 
 void print_midi_event(const char *source, jack_midi_event_t e) {